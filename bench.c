@@ -0,0 +1,80 @@
+#define _POSIX_C_SOURCE 199309L /* clock_gettime */
+
+#include <stdio.h>
+#include <stdlib.h> /* strtoull */
+#include <string.h> /* strcmp */
+#include <time.h> /* clock_gettime */
+
+#include "internal.h"
+
+/* Random-size churn: keep a number of slots, and over and over pick one at
+ * random, freeing what it holds or allocating into it a block of random size
+ * up to a maximum whose first bytes are written, as callers do. Print the
+ * average time of an operation and what the heap looked like at the end:
+ *
+ *    $ ./bench [-n ops] [-s slots] [-m max_size] [-r seed]
+ *
+ * The allocator is linked in, configured from the environment as usual. Build
+ * it with optimizations for numbers that mean anything:
+ *
+ *    $ make clean && make bench CFLAGS="-std=c99 -fPIC -O2 -g"
+ */
+
+static u64 rngstate;
+
+static u64 rng(void) {
+    rngstate ^= rngstate << 13;
+    rngstate ^= rngstate >> 7;
+    rngstate ^= rngstate << 17;
+    return rngstate;
+}
+
+static u64 now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    u64 nops = 10000000, nslots = 20000, maxsz = 2048;
+    rngstate = 0x9e3779b97f4a7c15ull;
+    for (int i = 1; i < argc; i += 2) {
+        u64 v = i + 1 < argc ? strtoull(argv[i + 1], 0, 10) : 0;
+        if (!strcmp(argv[i], "-n") && v)
+            nops = v;
+        else if (!strcmp(argv[i], "-s") && v)
+            nslots = v;
+        else if (!strcmp(argv[i], "-m") && v)
+            maxsz = v;
+        else if (!strcmp(argv[i], "-r") && v)
+            rngstate = v;
+        else {
+            fprintf(stderr, "usage: %s [-n ops] [-s slots] [-m max_size] "
+                "[-r seed]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    minit();
+    char **slots = m_calloc(nslots, sizeof(char *));
+    if (!slots)
+        return 1;
+
+    u64 t = now();
+    for (u64 i = 0; i < nops; i++) {
+        u64 r = rng();
+        char **s = &slots[r % nslots];
+        if (*s) {
+            m_free(*s);
+            *s = 0;
+        } else if ((*s = m_malloc(1 + (r >> 32) % maxsz))) {
+            **s = (char)i;
+        }
+    }
+    t = now() - t;
+
+    printf("%.1f ns/op, %d spans, %" PRIu64 " bytes live, %" PRIu64
+        " mapped\n", (double)t / nops, heap->span_count, stats.live,
+        stats.mapped);
+    return 0;
+}
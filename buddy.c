@@ -0,0 +1,316 @@
+#include <string.h> /* memcpy */
+
+#include "internal.h"
+
+/* The buddy arenas serve page sized and larger requests (config.bd_minsz
+ * through config.bd_maxsz) when backend=buddy, as an alternative to the page
+ * heap.
+ *
+ * An arena is BD_ARENASZ bytes obtained from the OS aligned to its size, and
+ * registered in the page map. Its pages are split into blocks of 2^k pages,
+ * where k is the order of the block. A block of order k starts at a page
+ * index that is a multiple of 2^k, so every block is aligned to its own size:
+ * a 2mb request gets 2mb aligned memory. Each block of order k < top has a
+ * buddy, the other half of the block of order k + 1 they were split from,
+ * found by flipping bit k of the page index.
+ *
+ * ┌────────────────────────┐
+ * │struct segment          │
+ * │struct buddy            │ order 2 (header)
+ * │bits, links, order      │
+ * │                        │
+ * ├────────────────────────┤
+ * │block (in use)          │ order 1 ───┐ buddies
+ * ├────────────────────────┤            │
+ * │block (free)            │ order 1 <──┘
+ * ├────────────────────────┤
+ * │block (free)            │ order 3
+ * │...                     │
+ * └────────────────────────┘
+ *
+ * All bookkeeping is out of band, after the segment header: a bitmap per
+ * order with the bit of each free block set, free lists per order linked by
+ * page index, and the order of each allocated block. Allocation takes the
+ * first free block of the smallest order that fits and splits it down; freeing
+ * merges a block with its buddy for as long as the buddy is free. Both take at
+ * most one step per order.
+ */
+
+/* Keep at most BD_ARENACACHE arenas with no blocks in use. Blocks of order
+ * BD_PURGEORDER or more are returned to the OS when freed.
+ */
+enum {
+    BD_ARENACACHE = 1,
+    BD_PURGEORDER = 4,
+};
+
+static inline u32 *bdprev(struct buddy *bd, u32 idx) {
+    return &bd->links[2 * idx];
+}
+static inline u32 *bdnext(struct buddy *bd, u32 idx) {
+    return &bd->links[2 * idx + 1];
+}
+static inline u32 bdidx(struct segment *sg, void *p) {
+    return ((uptr)p - (uptr)sg) / pagesize;
+}
+static inline void *bdpage(struct segment *sg, u32 idx) {
+    return (byte *)sg + (usz)idx * pagesize;
+}
+
+/* The free bit of the block of order k at page idx.
+ */
+static inline b32 bdisfree(struct buddy *bd, u32 k, u32 idx) {
+    u32 bit = idx >> k;
+    return (bd->bits[k][bit / 64] >> (bit % 64)) & 1;
+}
+static inline void bdsetbit(struct buddy *bd, u32 k, u32 idx, b32 free) {
+    u32 bit = idx >> k;
+    u64 mask = (u64)1 << (bit % 64);
+    if (free)
+        bd->bits[k][bit / 64] |= mask;
+    else
+        bd->bits[k][bit / 64] &= ~mask;
+}
+
+/* The smallest order with enough pages for size bytes.
+ */
+static u32 bdorder(usz size) {
+    usz pages = ALIGN_UP(usz_max(size, 1), (usz)pagesize) / pagesize;
+    u32 k = 0;
+    while (((usz)1 << k) < pages)
+        k++;
+    return k;
+}
+
+/* The usable size of a request of size bytes.
+ */
+usz bdgoodsize(usz size) {
+    return (usz)pagesize << bdorder(size);
+}
+
+/* Put the block of order k at idx on its free list.
+ */
+static void bdpush(struct buddy *bd, u32 k, u32 idx) {
+    assert(idx % (1u << k) == 0);
+    bdsetbit(bd, k, idx, 1);
+    *bdprev(bd, idx) = 0;
+    *bdnext(bd, idx) = bd->heads[k];
+    if (bd->heads[k])
+        *bdprev(bd, bd->heads[k]) = idx;
+    bd->heads[k] = idx;
+}
+
+/* Take the free block of order k at idx off of its free list.
+ */
+static void bdsever(struct buddy *bd, u32 k, u32 idx) {
+    assert(bdisfree(bd, k, idx));
+    bdsetbit(bd, k, idx, 0);
+    u32 prev = *bdprev(bd, idx);
+    u32 next = *bdnext(bd, idx);
+    if (prev)
+        *bdnext(bd, prev) = next;
+    else
+        bd->heads[k] = next;
+    if (next)
+        *bdprev(bd, next) = prev;
+}
+
+/* Allocate a block of order k from arena sg, splitting the smallest larger
+ * free block if there is none of that order. The upper halves of the splits
+ * go to the free lists. Return the page index of the block, or 0.
+ */
+static u32 bdtake(struct segment *sg, u32 k) {
+    struct buddy *bd = segbuddy(sg);
+    u32 j = k;
+    while (j < bd->top && !bd->heads[j])
+        j++;
+    if (j == bd->top)
+        return 0;
+
+    u32 idx = bd->heads[j];
+    bdsever(bd, j, idx);
+    while (j > k) {
+        j--;
+        bdpush(bd, j, idx + (1u << j));
+    }
+
+    bd->order[idx] = k;
+    sg->nused += 1u << k;
+    return idx;
+}
+
+/* Map a new arena and lay out its bookkeeping. The header is the first block
+ * of the arena, as if it had been allocated from a single free block of the
+ * top order: its buddies on the way up make up the rest of the free lists.
+ */
+struct segment *bdarenaalloc(void) {
+    struct segment *sg = osmapaligned(BD_ARENASZ, BD_ARENASZ);
+    if (!sg)
+        return 0;
+    if (!pmset(sg, BD_ARENASZ, sg)) {
+        osunmap(sg, BD_ARENASZ);
+        return 0;
+    }
+    heap->arena_count++;
+
+    sg->size = BD_ARENASZ;
+    sg->kind = SEG_BUDDY;
+    sg->heap = heap;
+    sg->npages = BD_ARENASZ / pagesize;
+    sg->nused = 0;
+
+    /* Fresh memory is zero: every list is empty and every bit clear. */
+    struct buddy *bd = segbuddy(sg);
+    bd->top = bdorder(BD_ARENASZ);
+    assert(bd->top < BD_NORDERS);
+
+    byte *m = (byte *)(bd + 1);
+    for (u32 k = 0; k <= bd->top; k++) {
+        bd->bits[k] = (u64 *)m;
+        m += ALIGN_UP(sg->npages >> k, 64) / 8;
+    }
+    bd->links = (u32 *)m;
+    m += 2 * sg->npages * sizeof(u32);
+    bd->order = m;
+    m += sg->npages;
+
+    u32 hk = bdorder(m - (byte *)sg);
+    sg->hdrpages = 1u << hk;
+    bd->order[0] = hk;
+    for (u32 j = bd->top; j-- > hk; )
+        bdpush(bd, j, 1u << j);
+
+    sg->next = heap->arenabase;
+    if (sg->next)
+        sg->next->prev = sg;
+    heap->arenabase = sg;
+    return sg;
+}
+
+/* Return an entire arena to the OS. It must have no blocks in use. The free
+ * lists live in the arena, so there is nothing else to undo.
+ */
+void bdarenafree(struct segment *sg) {
+    assert(sg->nused == 0);
+
+    heap->arena_count--;
+    if (sg->prev)
+        sg->prev->next = sg->next;
+    else
+        heap->arenabase = sg->next;
+    if (sg->next)
+        sg->next->prev = sg->prev;
+
+    pmset(sg, sg->size, 0);
+    osunmap(sg, sg->size);
+}
+
+/* Serve a request of size bytes with a block of the smallest order that fits.
+ */
+void *bdalloc(usz size) {
+    u32 k = bdorder(size);
+    u32 idx;
+
+    for (struct segment *sg = heap->arenabase; sg; sg = sg->next) {
+        if ((idx = bdtake(sg, k)))
+            return bdpage(sg, idx);
+    }
+
+    struct segment *sg = bdarenaalloc();
+    if (!sg)
+        return 0;
+    idx = bdtake(sg, k);
+    assert(idx);
+    return bdpage(sg, idx);
+}
+
+/* Give back the block at p, merging it with its buddy as long as the buddy is
+ * free. When that leaves the arena empty, the arena is unmapped unless it is
+ * within the cache.
+ */
+void bdfree(struct segment *sg, void *p) {
+    struct buddy *bd = segbuddy(sg);
+    u32 idx = bdidx(sg, p);
+    u32 k = bd->order[idx];
+    assert(idx && !bdisfree(bd, k, idx));
+    sg->nused -= 1u << k;
+
+    if (k >= BD_PURGEORDER)
+        ospurge(p, (usz)pagesize << k);
+
+    while (k < bd->top) {
+        u32 buddy = idx ^ (1u << k);
+        if (!bdisfree(bd, k, buddy))
+            break;
+        bdsever(bd, k, buddy);
+        idx &= ~(1u << k);
+        k++;
+    }
+    bdpush(bd, k, idx);
+
+    if (sg->nused == 0 && heap->arena_count > BD_ARENACACHE)
+        bdarenafree(sg);
+}
+
+/* The number of usable bytes in the block at p.
+ */
+usz bdsize(struct segment *sg, void *p) {
+    return (usz)pagesize << segbuddy(sg)->order[bdidx(sg, p)];
+}
+
+/* Resize the block at p in place to the order that fits size bytes.
+ * Shrinking gives the upper halves back, purging the large ones. Growing
+ * works if p is aligned to the new order and the buddies on the way up are
+ * free. Return false if p can't grow.
+ */
+b32 bdresize(struct segment *sg, void *p, usz size) {
+    struct buddy *bd = segbuddy(sg);
+    u32 idx = bdidx(sg, p);
+    u32 k = bd->order[idx];
+    u32 nk = bdorder(size);
+
+    if (nk == k)
+        return 1;
+
+    if (nk < k) {
+        sg->nused -= (1u << k) - (1u << nk);
+        bd->order[idx] = nk;
+        while (k > nk) {
+            k--;
+            if (k >= BD_PURGEORDER)
+                ospurge(bdpage(sg, idx + (1u << k)), (usz)pagesize << k);
+            bdpush(bd, k, idx + (1u << k));
+        }
+        return 1;
+    }
+
+    if (nk >= bd->top || idx % (1u << nk))
+        return 0;
+
+    u32 j = k;
+    while (j < nk && bdisfree(bd, j, idx + (1u << j)))
+        j++;
+    if (j < nk)
+        return 0;
+
+    for (j = k; j < nk; j++)
+        bdsever(bd, j, idx + (1u << j));
+    sg->nused += (1u << nk) - (1u << k);
+    bd->order[idx] = nk;
+    return 1;
+}
+
+/* Resize the block at p to fit size bytes, moving the contents to a new
+ * allocation if it can't be done in place.
+ */
+void *bdrealloc(struct segment *sg, void *p, usz size) {
+    if (bdresize(sg, p, size))
+        return p;
+
+    void *q = alloc(size, 0);
+    if (!q)
+        return 0;
+    memcpy(q, p, bdsize(sg, p));
+    bdfree(sg, p);
+    return q;
+}
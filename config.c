@@ -0,0 +1,169 @@
+#include <stddef.h> /* offsetof */
+#include <stdlib.h> /* getenv, strtoull */
+#include <string.h> /* strcspn, strlen, strncmp */
+
+#include "internal.h"
+
+/* Knobs, read once from the environment on the first call to malloc(). The
+ * variable holds comma separated key=value pairs, e.g.
+ *
+ *    BABY_MALLOC_CONF=backend=blocks
+ *    BABY_MALLOC_CONF=ph_minsz=32k,ph_maxsz=2m
+ *
+ * BABY_MALLOC_CONF_FILE names a file with pairs in the same form, separated
+ * by commas or newlines, such as the output of tune. It is read first, so
+ * BABY_MALLOC_CONF can override it.
+ *
+ * Sizes are decimal, or hexadecimal with a 0x prefix, and take an optional k,
+ * m or g suffix. Unknown keys and malformed values are ignored.
+ */
+struct config config = {
+    .backend = BACKEND_PAGES,
+    .span_minsz = MIN_MMAPSZ,
+    .ph_minsz = 16 * 1024,
+    .ph_maxsz = 1024 * 1024,
+    .bd_minsz = 4 * 1024,
+    .bd_maxsz = 32 * 1024 * 1024,
+    .cold_ticks = 0,
+    .cold_freepct = 10,
+    .lc_minsz = 1024 * 1024,
+    .lc_maxsz = 64 * 1024 * 1024,
+    .va_headroom = 0,
+    .lc_ticks = 10000,
+    .det_base = 0,
+    .det_size = (usz)4 * 1024 * 1024 * 1024,
+    .tm_ring = 0,
+    .tm_sample = 16,
+    .snap_every = 0,
+    .cow = 0,
+    .site_ticks = 0,
+    .site_sample = 16,
+    .leak_every = 0,
+    .leak_sample = 64,
+    .leak_runs = 4,
+};
+
+static const char *const backends[] = { "blocks", "pages", "buddy", 0 };
+
+static const struct option {
+    const char *name;
+    usz off;                    /* offset of the knob in struct config */
+    const char *const *names;   /* names of the values, or 0 for a size */
+} options[] = {
+    { "backend", offsetof(struct config, backend), backends },
+    { "span_minsz", offsetof(struct config, span_minsz), 0 },
+    { "ph_minsz", offsetof(struct config, ph_minsz), 0 },
+    { "ph_maxsz", offsetof(struct config, ph_maxsz), 0 },
+    { "bd_minsz", offsetof(struct config, bd_minsz), 0 },
+    { "bd_maxsz", offsetof(struct config, bd_maxsz), 0 },
+    { "cold_ticks", offsetof(struct config, cold_ticks), 0 },
+    { "cold_freepct", offsetof(struct config, cold_freepct), 0 },
+    { "lc_minsz", offsetof(struct config, lc_minsz), 0 },
+    { "lc_maxsz", offsetof(struct config, lc_maxsz), 0 },
+    { "va_headroom", offsetof(struct config, va_headroom), 0 },
+    { "lc_ticks", offsetof(struct config, lc_ticks), 0 },
+    { "det_base", offsetof(struct config, det_base), 0 },
+    { "det_size", offsetof(struct config, det_size), 0 },
+    { "tm_ring", offsetof(struct config, tm_ring), 0 },
+    { "tm_sample", offsetof(struct config, tm_sample), 0 },
+    { "snap_every", offsetof(struct config, snap_every), 0 },
+    { "cow", offsetof(struct config, cow), 0 },
+    { "site_ticks", offsetof(struct config, site_ticks), 0 },
+    { "site_sample", offsetof(struct config, site_sample), 0 },
+    { "leak_every", offsetof(struct config, leak_every), 0 },
+    { "leak_sample", offsetof(struct config, leak_sample), 0 },
+    { "leak_runs", offsetof(struct config, leak_runs), 0 },
+};
+
+/* Parse the len bytes at s as a size with an optional k, m or g suffix.
+ */
+static b32 parsesize(const char *s, usz len, usz *val) {
+    char *end;
+    if (!len || *s < '0' || *s > '9')
+        return 0;
+
+    int b = len > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X') ? 16 : 10;
+    u64 n = strtoull(s, &end, b);
+    usz rest = len - (end - s);
+    if (rest == 1) {
+        switch (*end) {
+        case 'k': case 'K': n <<= 10; break;
+        case 'm': case 'M': n <<= 20; break;
+        case 'g': case 'G': n <<= 30; break;
+        default: return 0;
+        }
+    } else if (rest) {
+        return 0;
+    }
+
+    *val = n;
+    return 1;
+}
+
+/* Parse the len bytes at s as one of the given value names.
+ */
+static b32 parsename(const char *s, usz len, const char *const *names,
+    usz *val) {
+    for (usz i = 0; names[i]; i++) {
+        if (strlen(names[i]) == len && !strncmp(s, names[i], len)) {
+            *val = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Apply a single key=value pair of len bytes to c.
+ */
+static b32 configpair(struct config *c, const char *s, usz len) {
+    const char *eq = memchr(s, '=', len);
+    if (!eq)
+        return 0;
+
+    usz klen = eq - s;
+    const char *v = eq + 1;
+    usz vlen = len - klen - 1;
+
+    for (usz i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+        const struct option *o = &options[i];
+        if (strlen(o->name) != klen || strncmp(s, o->name, klen))
+            continue;
+        usz *val = (usz *)((byte *)c + o->off);
+        if (o->names)
+            return parsename(v, vlen, o->names, val);
+        return parsesize(v, vlen, val);
+    }
+    return 0;
+}
+
+/* Apply every pair in s to c. Return false if any of them was not understood.
+ */
+b32 configset(struct config *c, const char *s) {
+    b32 ok = 1;
+    while (*s) {
+        usz len = strcspn(s, ",\n");
+        if (len && !configpair(c, s, len))
+            ok = 0;
+        s += len;
+        if (*s)
+            s++;
+    }
+    return ok;
+}
+
+/* Apply every pair in s to the knobs of the process and the default heap.
+ */
+b32 configparse(const char *s) {
+    return configset(&config, s);
+}
+
+void configinit(void) {
+    static char buf[4096];
+    const char *path = getenv("BABY_MALLOC_CONF_FILE");
+    if (path && osreadfile(path, buf, sizeof(buf)))
+        configparse(buf);
+
+    const char *s = getenv("BABY_MALLOC_CONF");
+    if (s)
+        configparse(s);
+}
@@ -2,7 +2,7 @@
 #include <dlfcn.h> /* dlsym, RTLD_NEXT */
 
 #include "malloc.h"     /* m_malloc et al */
-#include "internal.h"   /* b32, plforeign */
+#include "internal.h"   /* b32, plforeign, mallocfrom */
 
 /* Something inside glibc might call the internal allocator and then try to
  * free() it. Since we put our free() at the front of the loader's symbol
@@ -27,10 +27,57 @@ static void forward_free(void *p) {
     _free(p);
 }
 
+/* Allocation hooks, installed with malloc_set_hooks(). on_alloc() sees every
+ * pointer handed out along with the size asked for and its usable size, and
+ * on_free() sees every pointer given back along with its usable size. A
+ * realloc() that succeeds is a free of the old pointer and an allocation of
+ * the new one. Calls made from inside a hook, on the same thread, are not
+ * reported, so hooks may allocate.
+ *
+ * With no hooks installed, the only cost is the branch on hooked.
+ */
+static void (*on_alloc)(void *, size_t, size_t) = 0;
+static void (*on_free)(void *, size_t) = 0;
+static int hooked = 0;
+static __thread int inhook = 0;
+
+#define HOOKED  __builtin_expect(hooked, 0)
+
+static void hookalloc(void *p, size_t size) {
+    if (!p || !on_alloc || inhook)
+        return;
+    inhook = 1;
+    on_alloc(p, size, plusable(p));
+    inhook = 0;
+}
+
+static void hookfree(void *p, size_t usable) {
+    if (!p || !on_free || inhook)
+        return;
+    inhook = 1;
+    on_free(p, usable);
+    inhook = 0;
+}
+
+static void *hookrealloc(void *p, size_t s) {
+    size_t old = p ? plusable(p) : 0;
+    void *q = m_realloc(p, s);
+    if (!q)
+        return 0;
+    hookfree(p, old);
+    hookalloc(q, s);
+    return q;
+}
+
 /* The definitions of the actual public malloc() API.
  */
 __attribute__((visibility("default")))
-void *malloc(size_t s) { return m_malloc(s); }
+void *malloc(size_t s) {
+    void *p = mallocfrom(s, __builtin_return_address(0));
+    if (HOOKED)
+        hookalloc(p, s);
+    return p;
+}
 
 __attribute__((visibility("default")))
 void free(void *p) {
@@ -38,12 +85,149 @@ void free(void *p) {
     forward_free(p);
     return;
   }
+  if (HOOKED)
+    hookfree(p, p ? plusable(p) : 0);
   m_free(p);
 }
 
 __attribute__((visibility("default")))
-void *calloc(size_t n, size_t s) { return m_calloc(n, s); }
+void *calloc(size_t n, size_t s) {
+    void *p = callocfrom(n, s, __builtin_return_address(0));
+    if (HOOKED)
+        hookalloc(p, n * s);
+    return p;
+}
+
+__attribute__((visibility("default")))
+void *realloc(void *p, size_t s) {
+    if (HOOKED)
+        return hookrealloc(p, s);
+    return m_realloc(p, s);
+}
+
+
+/* Extensions, declared by the caller since there is no public header. */
+__attribute__((visibility("default")))
+size_t malloc_expand(void *p, size_t min, size_t max) {
+    if (!HOOKED || !p)
+        return m_expand(p, min, max);
+
+    size_t old = plusable(p);
+    size_t usable = m_expand(p, min, max);
+    if (usable != old) {
+        hookfree(p, old);
+        hookalloc(p, usable);
+    }
+    return usable;
+}
+
+__attribute__((visibility("default")))
+size_t malloc_good_size(size_t size, int flags) {
+    return m_good_size(size, flags);
+}
+
+__attribute__((visibility("default")))
+void malloc_utilization(void *p, struct m_utilization *u) {
+    m_utilization(p, u);
+}
+
+__attribute__((visibility("default")))
+void *malloc_near(void *hint, size_t s) {
+    void *p = m_malloc_near(hint, s);
+    if (HOOKED)
+        hookalloc(p, s);
+    return p;
+}
+
+__attribute__((visibility("default")))
+struct m_heap *malloc_heap_create(const char *conf) {
+    return m_heap_create(conf);
+}
+
+__attribute__((visibility("default")))
+void malloc_heap_destroy(struct m_heap *h) {
+    m_heap_destroy(h);
+}
+
+__attribute__((visibility("default")))
+void *malloc_heap_alloc(struct m_heap *h, size_t s) {
+    void *p = m_heap_malloc(h, s);
+    if (HOOKED)
+        hookalloc(p, s);
+    return p;
+}
+
+__attribute__((visibility("default")))
+void *malloc_heap_calloc(struct m_heap *h, size_t n, size_t s) {
+    void *p = m_heap_calloc(h, n, s);
+    if (HOOKED)
+        hookalloc(p, n * s);
+    return p;
+}
+
+/* malloc() with a tag, see m_malloc_tagged(). Like malloc(), it passes its
+ * own caller on as the call site.
+ */
+__attribute__((visibility("default")))
+void *malloc_tagged(size_t s, unsigned tag) {
+    unsigned cur = m_set_tag(tag);
+    void *p = mallocfrom(s, __builtin_return_address(0));
+    m_set_tag(cur);
+    if (HOOKED)
+        hookalloc(p, s);
+    return p;
+}
+
+__attribute__((visibility("default")))
+unsigned malloc_set_tag(unsigned tag) {
+    return m_set_tag(tag);
+}
+
+__attribute__((visibility("default")))
+void malloc_tag_stats(unsigned tag, struct m_tag_stats *s) {
+    m_tag_stats(tag, s);
+}
+
+__attribute__((visibility("default")))
+void malloc_leak_report(void) {
+    m_leak_report();
+}
+
+__attribute__((visibility("default")))
+void malloc_get_stats(struct m_stats *s) {
+    m_stats(s);
+}
+
+/* Pool objects are not reported to the hooks: they are not malloc() blocks,
+ * and hooks may ask for their usable size.
+ */
+__attribute__((visibility("default")))
+struct m_pool *malloc_pool_create(size_t size) {
+    return m_pool_create(size);
+}
+
+__attribute__((visibility("default")))
+void malloc_pool_destroy(struct m_pool *pl) {
+    m_pool_destroy(pl);
+}
 
 __attribute__((visibility("default")))
-void *realloc(void *p, size_t s) { return m_realloc(p, s); }
+void *malloc_pool_alloc(struct m_pool *pl) {
+    return m_pool_alloc(pl);
+}
 
+__attribute__((visibility("default")))
+void malloc_pool_free(struct m_pool *pl, void *p) {
+    m_pool_free(pl, p);
+}
+
+/* Install the allocation hooks described above. Either may be 0; passing 0
+ * for both removes them.
+ */
+__attribute__((visibility("default")))
+void malloc_set_hooks(void (*alloc_hook)(void *p, size_t size, size_t usable),
+    void (*free_hook)(void *p, size_t usable)) {
+    on_alloc = alloc_hook;
+    on_free = free_hook;
+    hooked = alloc_hook || free_hook;
+}
@@ -0,0 +1,115 @@
+#include "internal.h"
+
+/* Heaps are allocator instances. The default heap, defheap, serves malloc()
+ * and is tuned with BABY_MALLOC_CONF. Other heaps are made with
+ * m_heap_create(), each with its own knobs on top of those, and serve
+ * m_heap_malloc() and m_heap_calloc(): network buffers can come from large
+ * spans kept in a big cache while parsed documents come from the page heap,
+ * and neither fragments the other.
+ *
+ * The code of the allocator works on the current heap, heap. The entry
+ * points for new allocations switch it to the heap they are asked to use,
+ * and those that take a pointer to the heap that owns it, found in the
+ * header of its span or segment; free() and realloc() work on pointers from
+ * any heap. Only the knobs from backend through lc_ticks are per heap; the
+ * rest are for the process.
+ */
+
+struct heap defheap = { .config = &config };
+struct heap *heap = &defheap;
+
+/* Make a heap with the knobs of the default heap, overridden by the pairs in
+ * conf, in the form of BABY_MALLOC_CONF. Return 0 if conf is malformed or the
+ * heap could not be mapped.
+ */
+struct m_heap *m_heap_create(const char *conf) {
+    if (pagesize == 0)
+        minit();
+
+    struct heap *h = osmap(ALIGN_UP(sizeof(struct heap), (usz)pagesize));
+    if (!h)
+        return 0;
+    h->conf = config;
+    h->config = &h->conf;
+    if (conf && !configset(&h->conf, conf)) {
+        osunmap(h, ALIGN_UP(sizeof(struct heap), (usz)pagesize));
+        return 0;
+    }
+
+    h->next = defheap.next;
+    defheap.next = h;
+    return (struct m_heap *)h;
+}
+
+/* Unmap a list of segments, in use or not, whose heap is going away.
+ */
+static void segunmapall(struct segment *sg) {
+    for (struct segment *next; sg; sg = next) {
+        next = sg->next;
+        pmset(sg, sg->size, 0);
+        osunmap(sg, sg->size);
+    }
+}
+
+/* Stop counting the tagged and sampled allocations of h, which is going
+ * away. A delete may move a later entry into slot i, so i is looked at again.
+ */
+static void heapforget(struct heap *h) {
+    for (usz i = 0; tgtab.count && i < tgtab.cap; ) {
+        void *p = (void *)tgtab.slots[i].p;
+        if (p && plheap(p) == h)
+            tgdrop(p, plusable(p));
+        else
+            i++;
+    }
+    for (usz i = 0; lktab.count && i < lktab.cap; ) {
+        void *p = (void *)lktab.slots[i].p;
+        if (p && plheap(p) == h)
+            leakdrop(p);
+        else
+            i++;
+    }
+}
+
+/* Unmap every span, segment and arena of a heap and the heap itself. Its
+ * allocations are gone, without being freed one by one, and their tags and
+ * leak samples with them.
+ */
+void m_heap_destroy(struct m_heap *mh) {
+    struct heap *h = (struct heap *)mh;
+    if (!h || h == &defheap)
+        return;
+
+    heapforget(h);
+    struct heap *cur = heap;
+    heap = h;
+    while (h->base)
+        spfree(h->base);
+    lcflush();
+    heap = cur;
+    segunmapall(h->segbase);
+    segunmapall(h->arenabase);
+    stats.live -= h->live;
+
+    struct heap **pp = &defheap.next;
+    while (*pp != h)
+        pp = &(*pp)->next;
+    *pp = h->next;
+    osunmap(h, ALIGN_UP(sizeof(struct heap), (usz)pagesize));
+}
+
+void *m_heap_malloc(struct m_heap *mh, size_t n) {
+    struct heap *cur = heap;
+    heap = (struct heap *)mh;
+    void *p = mallocfrom(n, __builtin_return_address(0));
+    heap = cur;
+    return p;
+}
+
+void *m_heap_calloc(struct m_heap *mh, size_t n, size_t s) {
+    struct heap *cur = heap;
+    heap = (struct heap *)mh;
+    void *p = callocfrom(n, s, __builtin_return_address(0));
+    heap = cur;
+    return p;
+}
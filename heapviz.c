@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h> /* malloc, realloc, qsort */
+
+#include "internal.h"
+
+/* Render a file of heap snapshots (see snapshot.c) as an HTML page:
+ *
+ *    $ BABY_MALLOC_CONF=snap_every=1000 LD_PRELOAD=./malloc.so ./server
+ *    $ ./heapviz baby-malloc.heap.1234 > heap.html
+ *
+ * The first picture is a heat map with a row per region (span or page heap
+ * segment) and a column per snapshot, colored by the fraction of the region
+ * in use: blue is idle, red is full. A region that stays blue for a long
+ * stretch is pinned by a few live blocks. The second picture is the layout of
+ * every region in the last snapshot, block by block.
+ */
+
+struct region {
+    u64 addr;
+    u64 size;
+    u64 kind;
+    u64 nblocks;
+    u64 used;                   /* bytes in use */
+    u64 nused;                  /* blocks in use */
+    u64 *blocks;                /* into the file */
+};
+
+struct snap {
+    u64 calls;
+    u64 nregions;
+    struct region *regions;
+};
+
+enum {
+    CELLH = 12,
+    LABELW = 150,
+    MAPW = 1200,
+};
+
+static u64 *words;
+static usz nwords;
+
+static u64 *rows;
+static usz nrows;
+
+static void *xrealloc(void *p, usz size) {
+    p = realloc(p, size);
+    if (!p) {
+        perror("heapviz");
+        exit(1);
+    }
+    return p;
+}
+
+static int cmpu64(const void *a, const void *b) {
+    u64 x = *(const u64 *)a, y = *(const u64 *)b;
+    return x < y ? -1 : x > y;
+}
+
+static usz rowof(u64 addr) {
+    usz lo = 0, hi = nrows;
+    while (lo < hi) {
+        usz mid = (lo + hi) / 2;
+        if (rows[mid] < addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* The fill of a cell with utilization u, from blue to red. */
+static int hue(double u) {
+    return (int)(240 * (1 - u));
+}
+
+static void readfile(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    usz cap = 0;
+    for (;;) {
+        if (nwords == cap) {
+            cap = cap ? 2 * cap : 4096;
+            words = xrealloc(words, cap * sizeof(u64));
+        }
+        usz n = fread(words + nwords, sizeof(u64), cap - nwords, f);
+        if (!n)
+            break;
+        nwords += n;
+    }
+    fclose(f);
+}
+
+/* Split the words into snapshots. A truncated last snapshot is dropped. */
+static struct snap *parse(usz *nsnaps) {
+    struct snap *snaps = 0;
+    usz n = 0, i = 0;
+    while (i + 3 <= nwords && words[i] == SNAP_MAGIC) {
+        struct snap s = { words[i + 1], words[i + 2], 0 };
+        i += 3;
+        s.regions = xrealloc(0, (s.nregions + 1) * sizeof(struct region));
+        u64 j;
+        for (j = 0; j < s.nregions && i + 4 <= nwords; j++) {
+            struct region *r = &s.regions[j];
+            r->addr = words[i];
+            r->size = words[i + 1];
+            r->kind = words[i + 2];
+            r->nblocks = words[i + 3];
+            r->blocks = &words[i + 4];
+            i += 4;
+            if (i + r->nblocks > nwords)
+                break;
+            r->used = r->nused = 0;
+            for (u64 k = 0; k < r->nblocks; k++) {
+                u64 w = r->blocks[k];
+                if (w & SNAP_INUSE) {
+                    r->used += w & ~(u64)SNAP_INUSE;
+                    r->nused++;
+                }
+            }
+            i += r->nblocks;
+        }
+        if (j < s.nregions) {
+            free(s.regions);
+            break;
+        }
+        snaps = xrealloc(snaps, (n + 1) * sizeof(struct snap));
+        snaps[n++] = s;
+    }
+    *nsnaps = n;
+    return snaps;
+}
+
+static void heatmap(struct snap *snaps, usz nsnaps) {
+    int cw = MAPW / (int)nsnaps;
+    cw = cw < 1 ? 1 : cw > 16 ? 16 : cw;
+    printf("<h3>Utilization by region over %zu snapshots</h3>\n", nsnaps);
+    printf("<svg width=\"%d\" height=\"%zu\">\n",
+        LABELW + cw * (int)nsnaps, nrows * CELLH);
+    for (usz r = 0; r < nrows; r++)
+        printf("<text x=\"0\" y=\"%zu\">%#" PRIx64 "</text>\n",
+            r * CELLH + CELLH - 2, rows[r]);
+
+    for (usz t = 0; t < nsnaps; t++) {
+        for (u64 j = 0; j < snaps[t].nregions; j++) {
+            struct region *g = &snaps[t].regions[j];
+            double u = g->size ? (double)g->used / g->size : 0;
+            printf("<rect x=\"%d\" y=\"%zu\" width=\"%d\" height=\"%d\" "
+                "fill=\"hsl(%d,80%%,50%%)\"><title>call %" PRIu64 ", %s %#"
+                PRIx64 ": %" PRIu64 " of %" PRIu64 " bytes in %" PRIu64
+                " of %" PRIu64 " blocks</title></rect>\n",
+                LABELW + (int)t * cw, rowof(g->addr) * CELLH, cw, CELLH - 1,
+                hue(u), snaps[t].calls,
+                g->kind == SNAP_SPAN ? "span" : "segment", g->addr,
+                g->used, g->size, g->nused, g->nblocks);
+        }
+    }
+    printf("</svg>\n");
+}
+
+static void layout(struct snap *s) {
+    printf("<h3>Layout at call %" PRIu64 "</h3>\n", s->calls);
+    printf("<svg width=\"%d\" height=\"%" PRIu64 "\">\n",
+        LABELW + MAPW, s->nregions * CELLH);
+    for (u64 j = 0; j < s->nregions; j++) {
+        struct region *g = &s->regions[j];
+        u64 y = j * CELLH;
+        printf("<text x=\"0\" y=\"%" PRIu64 "\">%#" PRIx64 "</text>\n",
+            y + CELLH - 2, g->addr);
+
+        /* Spans start their blocks after the header, segments their runs
+         * after the header pages; either way the first block ends where
+         * the region does, counting back.
+         */
+        u64 off = g->size;
+        for (u64 k = 0; k < g->nblocks; k++)
+            off -= g->blocks[k] & ~(u64)SNAP_INUSE;
+        for (u64 k = 0; k < g->nblocks; k++) {
+            u64 w = g->blocks[k];
+            u64 size = w & ~(u64)SNAP_INUSE;
+            double x = (double)off * MAPW / g->size;
+            double wd = (double)size * MAPW / g->size;
+            printf("<rect x=\"%.2f\" y=\"%" PRIu64 "\" width=\"%.2f\" "
+                "height=\"%d\" fill=\"%s\" stroke=\"white\" "
+                "stroke-width=\"0.2\"><title>+%" PRIu64 " %" PRIu64
+                " bytes %s</title></rect>\n",
+                LABELW + x, y, wd < 0.5 ? 0.5 : wd, CELLH - 1,
+                w & SNAP_INUSE ? "#d33" : "#ccc", off, size,
+                w & SNAP_INUSE ? "in use" : "free");
+            off += size;
+        }
+    }
+    printf("</svg>\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s snapshot-file > out.html\n", argv[0]);
+        return 2;
+    }
+    readfile(argv[1]);
+
+    usz nsnaps;
+    struct snap *snaps = parse(&nsnaps);
+    if (!nsnaps) {
+        fprintf(stderr, "%s: no snapshots\n", argv[1]);
+        return 1;
+    }
+
+    /* One row per distinct region address, in address order. */
+    for (usz t = 0; t < nsnaps; t++) {
+        for (u64 j = 0; j < snaps[t].nregions; j++) {
+            rows = xrealloc(rows, (nrows + 1) * sizeof(u64));
+            rows[nrows++] = snaps[t].regions[j].addr;
+        }
+    }
+    qsort(rows, nrows, sizeof(u64), cmpu64);
+    usz n = 0;
+    for (usz r = 0; r < nrows; r++) {
+        if (!n || rows[n - 1] != rows[r])
+            rows[n++] = rows[r];
+    }
+    nrows = n;
+
+    printf("<!doctype html>\n<html><head><meta charset=\"utf-8\">"
+        "<title>%s</title>\n<style>body { font: 11px monospace; } "
+        "text { font: 10px monospace; }</style></head><body>\n", argv[1]);
+    heatmap(snaps, nsnaps);
+    layout(&snaps[nsnaps - 1]);
+    printf("</body></html>\n");
+    return 0;
+}
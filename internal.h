@@ -24,16 +24,183 @@ struct span {
     struct span *next;
     struct block *free_list;
     u32 blkcount;               /* number of allocated blocks */
+    u32 flags;                  /* SPAN_COLD, and the fork generation */
+    u64 lastuse;                /* tick of the last block alloc or free */
+    struct heap *heap;          /* heap that owns the span */
+    u32 headroom;               /* pages reserved after the span to grow into */
+    u32 ngrow;                  /* times its allocation moved to grow */
 };
 
+/* The free list links are 32-bit offsets from the owner span, in units of
+ * ALIGNMENT, so the size and both links fit in the first 16 bytes of the
+ * header. See blknext() and blkprev().
+ */
 struct block {
     usz size;                   /* size including header */
-    struct block *prev;         /* prev free block */
-    struct block *next;         /* next free block */
+    u32 prev;                   /* prev free block */
+    u32 next;                   /* next free block */
     struct span *owner;         /* span that holds ths block */
     u32 magic;                  /* 0xbebebebe */
 };
 
+/* Page descriptor of the page heap, see pageheap.c. */
+struct pgdesc {
+    u32 len;                    /* pages in the run, at both ends of it */
+    u32 state;                  /* PG_FREE, PG_USED or PG_HDR | PG_DIRTY */
+    struct pgdesc *prev;        /* prev free run of the same length */
+    struct pgdesc *next;        /* next free run of the same length */
+};
+
+/* A segment is a region aligned to its size and registered in the page map.
+ * Page heap segments (see pageheap.c) follow the header with an array of one
+ * descriptor per page, and buddy arenas (see buddy.c) with a struct buddy.
+ */
+struct segment {
+    usz size;                   /* size including header pages */
+    struct segment *prev;
+    struct segment *next;
+    u32 kind;                   /* SEG_PAGES or SEG_BUDDY */
+    u32 npages;                 /* pages in the segment */
+    u32 hdrpages;               /* pages taken by the header and metadata */
+    u32 nused;                  /* pages in use */
+    struct heap *heap;          /* heap that owns the segment */
+};
+
+/* Page run states. PG_DIRTY marks free runs whose pages may be resident, as
+ * opposed to fresh or purged ones.
+ */
+enum {
+    PG_FREE = 1,
+    PG_USED = 2,
+    PG_HDR = 3,
+    PG_STATE = 3,
+    PG_DIRTY = 4,
+};
+
+enum {
+    SEG_PAGES = 1,
+    SEG_BUDDY = 2,
+};
+
+/* Segments are PH_SEGSZ bytes and aligned to that size. The page map tracks
+ * memory in grains of the same size. The page heap serves up to PH_MAXSZ
+ * bytes whatever the configuration says, so a request always fits in a
+ * segment.
+ */
+enum {
+    PH_SEGSZ = 4 * 1024 * 1024,
+    PH_MAXSZ = PH_SEGSZ / 2,
+    PH_NLISTS = 128,            /* free run lists by length, see pageheap.c */
+    PM_SHIFT = 22,
+    PM_GRAIN = 1 << PM_SHIFT,
+};
+
+/* Buddy arenas are BD_ARENASZ bytes, aligned to that size. The header takes
+ * the first blocks, so the largest block that can be handed out is half an
+ * arena.
+ */
+enum {
+    BD_ARENASZ = 64 * 1024 * 1024,
+    BD_MAXSZ = BD_ARENASZ / 2,
+    BD_NORDERS = 24,
+};
+
+/* Bookkeeping of a buddy arena. A block of order k is 2^k pages, and starts
+ * at a page index that is a multiple of 2^k. Page indices stand for blocks in
+ * the free lists; 0 is the null link, since the header always takes page 0.
+ */
+struct buddy {
+    u32 top;                    /* order of the whole arena */
+    u32 heads[BD_NORDERS];      /* first free block of each order */
+    u32 *links;                 /* prev/next free block, two per page */
+    byte *order;                /* order of the block at each page */
+    u64 *bits[BD_NORDERS];      /* free bit of each block of each order */
+};
+
+/* Runtime knobs, see config.c. Those from backend through lc_ticks are the
+ * knobs of a heap; the rest are for the whole process and are only read from
+ * config.
+ */
+struct config {
+    usz backend;                /* BACKEND_BLOCKS, _PAGES or _BUDDY */
+    usz span_minsz;             /* smallest span mapped */
+    usz ph_minsz;               /* smallest request for the page heap */
+    usz ph_maxsz;               /* largest request for the page heap */
+    usz bd_minsz;               /* smallest request for the buddy arenas */
+    usz bd_maxsz;               /* largest request for the buddy arenas */
+    usz cold_ticks;             /* idle ticks before a span is cold, or 0 */
+    usz cold_freepct;           /* below this % of free RAM, page cold out */
+    usz lc_minsz;               /* smallest span for the large object cache */
+    usz lc_maxsz;               /* bytes the large object cache holds, or 0 */
+    usz va_headroom;            /* most address space behind a growing span */
+    usz lc_ticks;               /* idle ticks before a cached span decays */
+    usz det_base;               /* address of the deterministic region, or 0 */
+    usz det_size;               /* size of the deterministic region */
+    usz tm_ring;                /* bytes of the telemetry ring, or 0 */
+    usz tm_sample;              /* publish one in this many events */
+    usz snap_every;             /* calls between heap snapshots, or 0 */
+    usz cow;                    /* leave the spans of the parent in children */
+    usz site_ticks;             /* lifetime of a long-lived block, or 0 */
+    usz site_sample;            /* blocks per call site sample */
+    usz leak_every;             /* calls between leak profiles, or 0 */
+    usz leak_sample;            /* allocations per leak sample */
+    usz leak_runs;              /* profiles of growth before a report */
+};
+
+/* An allocator instance, with its own knobs and its own spans, page heap
+ * segments, buddy arenas and large object cache. New blocks come from the
+ * current heap, heap, which is defheap but during m_heap_malloc() and the
+ * like; frees and reallocs switch to the heap that owns the pointer. See
+ * heap.c.
+ */
+struct heap {
+    const struct config *config;
+    struct heap *next;          /* next heap made with m_heap_create() */
+    struct span *base;          /* spans, most recent first */
+    int span_count;
+    u64 coldscan_next;          /* tick of the next spcoldscan() */
+    u64 lcscan_next;            /* tick of the next lcscan() */
+    struct segment *segbase;    /* page heap segments */
+    int seg_count;
+    struct pgdesc *runs[2][PH_NLISTS];  /* free runs, clean and dirty */
+    struct segment *arenabase;  /* buddy arenas */
+    int arena_count;
+    struct span *lcbase;        /* large object cache, newest first */
+    int lc_count;
+    usz lc_bytes;
+    usz live;                   /* usable bytes handed out */
+    struct config conf;         /* what config points to, but in defheap */
+};
+
+enum {
+    BACKEND_BLOCKS = 0,         /* every request is a block in a span */
+    BACKEND_PAGES = 1,          /* medium requests go to the page heap */
+    BACKEND_BUDDY = 2,          /* page sized requests go to buddy arenas */
+};
+
+/* Counters of allocator activity. */
+struct stats {
+    u64 nalloc;                 /* successful malloc() and calloc() calls */
+    u64 nfree;                  /* free() calls on non-null pointers */
+    u64 nrealloc;               /* successful realloc() calls on non-null */
+    u64 live;                   /* usable bytes handed out and not freed */
+    u64 mapped;                 /* bytes mapped from the OS */
+    u64 nsys;                   /* system calls made for memory */
+};
+
+extern struct config config;
+extern struct stats stats;
+
+/* The counters of the calling thread, for code that runs on any thread. See
+ * stats.c.
+ */
+struct stats *shard(void);
+extern int pagesize;
+extern u64 tick;
+extern u32 forkgen;
+extern struct heap defheap;
+extern struct heap *heap;
+
 /* Keep at most SPAN_CACHE spans free to serve allocation requests. When blocks
  * are freed that leave their span entirely unused (blocks_used == 0), spans
  * above SPAN_CACHE are munmapped.
@@ -42,14 +209,36 @@ enum {
     SPAN_CACHE = 1,
 };
 
+/* Span flags. SPAN_COLD is set on spans the kernel has been told are cold,
+ * and cleared on their next block allocation or free. SPAN_LONG marks spans
+ * that serve call sites with long-lived blocks, see site.c. The bits from
+ * SPAN_GENSHIFT up hold the fork generation the span was mapped in, see
+ * spfork().
+ */
+enum {
+    SPAN_COLD = 1,
+    SPAN_LONG = 2,
+    SPAN_GENSHIFT = 8,
+};
+
+/* When realloc() shrinks a block and leaves at least TRIM_MINSZ bytes free
+ * behind it, the pages of that free space are given back to the OS. See
+ * blktrim().
+ */
+enum {
+    TRIM_MINSZ = 64 * 1024,
+};
+
 /* The block size is a multiple of ALIGNMENT = 16, so its binary representation
  * always has the 4 least significant bits set to 0. These can be used to pack
- * booleans that would otherwise consume a full word.
+ * booleans that would otherwise consume a full word. BIT_ZEROED marks free
+ * blocks whose payload is all zeroes save for the footer, as in fresh spans.
  */
 enum {
     BIT_IN_USE = 1,
     BIT_PREV_IN_USE = 2,
-    BLK_MASK = BIT_IN_USE | BIT_PREV_IN_USE,
+    BIT_ZEROED = 4,
+    BLK_MASK = BIT_IN_USE | BIT_PREV_IN_USE | BIT_ZEROED,
 };
 
 /* Precomputed sizes of the headers and their padding, to be able to hop back
@@ -58,8 +247,14 @@ enum {
 enum {
     SPAN_HDR_PADSZ = ALIGN_UP(sizeof(struct span), ALIGNMENT),
     BLOCK_HDR_PADSZ = ALIGN_UP(sizeof(struct block), ALIGNMENT),
+    SEG_HDR_PADSZ = ALIGN_UP(sizeof(struct segment), ALIGNMENT),
 };
 
+/* A free list link can address ALIGNMENT * 2^32 bytes (64 GiB) from the start
+ * of its span. No span may be larger than that.
+ */
+#define SPAN_MAXSZ ((usz)UINT32_MAX * ALIGNMENT)
+
 /* Byte used in debugging to spot a freed block.
  */
 enum {
@@ -76,9 +271,12 @@ enum {
  */
 STATIC_ASSERT((SPAN_HDR_PADSZ % ALIGNMENT) == 0, span_header_size);
 STATIC_ASSERT((BLOCK_HDR_PADSZ % ALIGNMENT) == 0, block_header_size);
-STATIC_ASSERT(SPAN_HDR_PADSZ == 48, span_size_drifted);
-STATIC_ASSERT(BLOCK_HDR_PADSZ == 48, block_size_drifted);
+STATIC_ASSERT(SPAN_HDR_PADSZ == 64, span_size_drifted);
+STATIC_ASSERT(BLOCK_HDR_PADSZ == 32, block_size_drifted);
+STATIC_ASSERT(MIN_BLKSZ >= BLOCK_HDR_PADSZ + ALIGNMENT, min_blksz_fits_footer);
 STATIC_ASSERT((MIN_MMAPSZ & (MIN_MMAPSZ - 1)) == 0, min_mmapsz_power_of_two);
+STATIC_ASSERT(PH_SEGSZ == PM_GRAIN, segments_fill_page_map_grains);
+STATIC_ASSERT(BD_ARENASZ % PM_GRAIN == 0, arenas_fill_page_map_grains);
 
 static inline void assert_aligned(usz x, usz a) { assert(x % a == 0); }
 static inline void assert_ptr_aligned(void *p, usz a) { assert((uptr)p % a == 0); }
@@ -90,9 +288,11 @@ static inline void assert_ptr_aligned(void *p, usz a) { assert((uptr)p % a == 0)
  */
 static inline usz gross_size(usz size) { return BLOCK_HDR_PADSZ + ALIGN_UP(size, ALIGNMENT); }
 static inline usz usz_max(usz a, usz b) { return a > b ? a : b; }
+static inline usz usz_min(usz a, usz b) { return a < b ? a : b; }
 
 void *realloc_truncate(struct block *bp, usz size);
 void *realloc_extend(struct block *bp, usz size);
+b32 blkextend(struct block *bp, usz size);
 
 /****
  * Spans
@@ -100,9 +300,29 @@ void *realloc_extend(struct block *bp, usz size);
  ****/
 
 struct span *spalloc(usz gross);
+struct span *spallocgrow(usz gross, u32 n);
+b32 spgrow(struct span *sp, struct block *bp, usz size);
 void spfree(struct span *sp);
+void spretire(struct span *sp);
 struct block *spfirstblk(struct span *sp);
 void spsever(struct span *sp);
+void spcoldscan(void);
+void spfork(void);
+
+/* True if sp was mapped by the parent of a fork in cow mode. Its blocks are
+ * immortal: they are never freed or resized, so its pages stay shared.
+ */
+static inline b32 spinherited(struct span *sp) {
+    return sp->flags >> SPAN_GENSHIFT != forkgen;
+}
+
+/* Record block activity in sp. The tick advances with every block allocation
+ * and free, and a span is idle for as many ticks as have passed since.
+ */
+static inline void sptouch(struct span *sp) {
+    sp->lastuse = ++tick;
+    sp->flags &= ~SPAN_COLD;
+}
 
 /****
  * Blocks
@@ -119,9 +339,12 @@ void blkcoalesce(struct block *bp, struct block *bq);
 void blkprepend(struct block *bp);
 void blksever(struct block *bp);
 struct block *blkfind(usz gross);
+struct block *blkfindin(usz gross, u32 lng);
+struct block *blkfindnear(struct span *sp, usz gross, void *p);
 struct block *blkprevadj(struct block *bp);
 struct block *blknextadj(struct block *bp);
 struct block *blksplit(struct block *bp, usz gross);
+void blktrim(struct block *bp);
 
 static inline usz blksizerequest(usz size) {
     return usz_max(MIN_BLKSZ, gross_size(size));
@@ -143,10 +366,41 @@ static inline void blksetprevfree(struct block *bp) {
 static inline void blksetprevused(struct block *bp) {
     bp->size |= BIT_PREV_IN_USE;
 }
+static inline b32 blkiszeroed(struct block *bp) {
+    return bp->size & BIT_ZEROED;
+}
+static inline void blksetzeroed(struct block *bp) { bp->size |= BIT_ZEROED; }
+static inline void blksetdirty(struct block *bp) { bp->size &= ~BIT_ZEROED; }
 static inline usz blksize(struct block *bp) { return bp->size & ~BLK_MASK; }
 static inline void blksetsize(struct block *bp, usz size) {
     bp->size = size | (bp->size & BLK_MASK);
 }
+
+/* Encode and decode the free list link to bp as an offset from span sp. Offset
+ * 0 would land on the span header, where no block can start, so it stands for
+ * the null link.
+ */
+static inline u32 blklink(struct span *sp, struct block *bp) {
+    if (!bp)
+        return 0;
+    assert(bp->owner == sp);
+    return (u32)(((uptr)bp - (uptr)sp) / ALIGNMENT);
+}
+static inline struct block *blkunlink(struct span *sp, u32 off) {
+    return off ? (struct block *)((uptr)sp + (uptr)off * ALIGNMENT) : 0;
+}
+static inline struct block *blknext(struct block *bp) {
+    return blkunlink(bp->owner, bp->next);
+}
+static inline struct block *blkprev(struct block *bp) {
+    return blkunlink(bp->owner, bp->prev);
+}
+static inline void blksetnext(struct block *bp, struct block *bq) {
+    bp->next = blklink(bp->owner, bq);
+}
+static inline void blksetprev(struct block *bp, struct block *bq) {
+    bp->prev = blklink(bp->owner, bq);
+}
 static inline usz *blkprevfoot(struct block *bp) {
     return (usz *)((uptr)bp - sizeof(usz));
 }
@@ -160,6 +414,22 @@ static inline usz *blkfoot(struct block *bp) {
  ****/
 
 b32 plforeign(void *p);
+struct heap *plheap(void *p);
+usz plusable(void *p);
+b32 plresize(void *p, usz size);
+usz goodsize(usz size);
+void *alloc(usz size, u32 flags);
+void *mallocfrom(usz size, void *pc);
+void *callocfrom(usz n, usz s, void *pc);
+void dealloc(void *p);
+void *reallocate(void *p, usz size);
+void minit(void);
+
+/* Flags of alloc(). */
+enum {
+    ALLOC_ZERO = 1,             /* zero the memory */
+    ALLOC_LONG = 2,             /* from a span for long-lived blocks */
+};
 
 static inline struct block *plblk(void *p) {
     return (struct block *)((char *)p - BLOCK_HDR_PADSZ);
@@ -168,4 +438,242 @@ static inline usz plsize(struct block *bp) {
     return blksize(bp) - BLOCK_HDR_PADSZ;
 }
 
+/****
+ * OS
+ *
+ ****/
+
+void *osmap(usz size);
+void *osmapaligned(usz size, usz align);
+void osunmap(void *p, usz size);
+void *osreserve(usz size, usz room);
+b32 oscommit(void *p, usz size);
+b32 osdecommit(void *p, usz size);
+void osunreserve(void *p, usz size, usz room);
+void *osmapmt(usz size);
+void osunmapmt(void *p, usz size);
+void ospurge(void *p, usz size);
+b32 osshrink(void *p, usz size, usz nsize);
+void oscold(void *p, usz size, b32 pageout);
+b32 oslowmem(usz pct);
+b32 osdetinit(uptr hint, usz size);
+void *osshm(const char *path, usz size);
+void osshmfree(const char *path, void *p, usz size);
+u64 ospidpath(char *buf, const char *prefix);
+void osatfork(void (*child)(void));
+int oscreate(const char *path);
+void oswrite(int fd, const void *p, usz len);
+void osclose(int fd);
+usz osreadfile(const char *path, char *buf, usz cap);
+
+/****
+ * Config
+ *
+ ****/
+
+b32 configset(struct config *c, const char *s);
+b32 configparse(const char *s);
+void configinit(void);
+
+/****
+ * Call sites
+ *
+ ****/
+
+u32 siteof(void *pc);
+b32 sitelong(u32 s);
+void sitesample(void *p, u32 s);
+void sitefree(struct block *bp);
+
+/****
+ * Pointer tables
+ *
+ ****/
+
+struct ptslot {
+    uptr p;                     /* 0 when the slot is empty */
+    u32 a;
+    u32 b;
+};
+
+struct ptab {
+    struct ptslot *slots;
+    usz cap;                    /* power of 2, or 0 */
+    usz count;
+};
+
+struct ptslot *ptget(struct ptab *t, void *p);
+struct ptslot *ptput(struct ptab *t, void *p);
+void ptdel(struct ptab *t, struct ptslot *s);
+
+/****
+ * Tags
+ *
+ ****/
+
+extern __thread u32 tg_current;
+extern struct ptab tgtab;
+extern struct m_tag_stats tgstats[M_NTAGS];
+
+void tgput(void *p, u32 tag, usz usable);
+u32 tgdrop(void *p, usz usable);
+void tgmove(void *q, void *p, usz old, usz usable);
+
+/****
+ * Leaks
+ *
+ ****/
+
+/* Leak reports go to LEAK_PATH followed by the pid. See leak.c. */
+#define LEAK_PATH   "baby-malloc.leaks."
+
+extern struct ptab lktab;
+
+void leaktick(void);
+void leaksample(void *p, void *pc);
+void leakdrop(void *p);
+void leakmove(void *q, void *p);
+void leakfini(void);
+void leakfork(void);
+
+/****
+ * Large object cache
+ *
+ ****/
+
+b32 lcput(struct span *sp);
+struct span *lctake(usz spsz);
+void lcflush(void);
+void lcscan(void);
+
+/****
+ * Telemetry
+ *
+ ****/
+
+/* The telemetry ring lives in a shared memory file, TM_PATH followed by the
+ * pid, for tmread to attach to. See telemetry.c.
+ */
+#define TM_PATH     "/dev/shm/baby-malloc."
+#define TM_MAGIC    0xbabe7e1e
+
+enum {
+    TM_ALLOC = 1,
+    TM_FREE = 2,
+    TM_REALLOC = 3,
+};
+
+/* An event in the ring. seq is the 1-based number of the event, and is 0
+ * while the slot is being written.
+ */
+struct tmevent {
+    u64 seq;
+    u64 tick;
+    u32 kind;                   /* TM_ALLOC, TM_FREE or TM_REALLOC */
+    u32 pad;
+    u64 p;                      /* the pointer handed out or freed */
+    u64 q;                      /* the old pointer of a realloc() */
+    u64 size;                   /* the size asked for */
+};
+
+struct tmring {
+    u32 magic;                  /* TM_MAGIC */
+    u32 nslots;                 /* events in the ring, a power of 2 */
+    u64 head;                   /* events published so far */
+    u64 statseq;                /* odd while the snapshot is being written */
+    struct stats stats;         /* snapshot as of the last event */
+    struct tmevent ring[];
+};
+
+extern struct tmring *tmring;
+
+b32 tminit(void);
+void tmfini(void);
+void tmrecord(u32 kind, void *p, void *q, usz size);
+void tmfork(void);
+
+/****
+ * Heap snapshots
+ *
+ ****/
+
+/* Snapshots go to SNAP_PATH followed by the pid. See snapshot.c for the
+ * format.
+ */
+#define SNAP_PATH   "baby-malloc.heap."
+#define SNAP_MAGIC  0x70616e73u         /* "snap" */
+
+enum {
+    SNAP_SPAN = 1,
+    SNAP_PAGES = 2,
+    SNAP_INUSE = 1,             /* low bit of a block size */
+};
+
+void snapshot(void);
+void snaptick(void);
+void snapfini(void);
+void snapfork(void);
+
+/****
+ * Page map
+ *
+ ****/
+
+b32 pmset(void *p, usz len, struct segment *sg);
+struct segment *pmget(void *p);
+
+/****
+ * Page heap
+ *
+ ****/
+
+struct segment *segalloc(void);
+void segfree(struct segment *sg);
+void runpurge(struct pgdesc *d);
+void *phalloc(usz size, b32 zero);
+void phfree(struct segment *sg, void *p);
+usz phsize(struct segment *sg, void *p);
+b32 phresize(struct segment *sg, void *p, usz size);
+void *phrealloc(struct segment *sg, void *p, usz size);
+
+/* True if a request for size bytes goes to the page heap.
+ */
+static inline b32 phserves(usz size) {
+    return heap->config->backend == BACKEND_PAGES && heap->config->ph_minsz <= size
+        && size <= heap->config->ph_maxsz && size <= PH_MAXSZ;
+}
+
+/* The page descriptors follow the segment header.
+ */
+static inline struct pgdesc *segdesc(struct segment *sg) {
+    return (struct pgdesc *)((byte *)sg + SEG_HDR_PADSZ);
+}
+
+/****
+ * Buddy arenas
+ *
+ ****/
+
+struct segment *bdarenaalloc(void);
+void bdarenafree(struct segment *sg);
+void *bdalloc(usz size);
+void bdfree(struct segment *sg, void *p);
+usz bdsize(struct segment *sg, void *p);
+usz bdgoodsize(usz size);
+b32 bdresize(struct segment *sg, void *p, usz size);
+void *bdrealloc(struct segment *sg, void *p, usz size);
+
+/* True if a request for size bytes goes to the buddy arenas.
+ */
+static inline b32 bdserves(usz size) {
+    return heap->config->backend == BACKEND_BUDDY && heap->config->bd_minsz <= size
+        && size <= heap->config->bd_maxsz && size <= BD_MAXSZ;
+}
+
+/* The buddy bookkeeping follows the segment header.
+ */
+static inline struct buddy *segbuddy(struct segment *sg) {
+    return (struct buddy *)((byte *)sg + SEG_HDR_PADSZ);
+}
+
 #endif
@@ -0,0 +1,127 @@
+#include "internal.h"
+
+/* The large object cache keeps spans of at least config.lc_minsz bytes that
+ * were left empty, instead of unmapping them right away. A program that
+ * allocates and frees big buffers over and over then reuses pages that are
+ * already mapped and faulted in, rather than paying for mmap(2), munmap(2)
+ * and a page fault per page every time.
+ *
+ * Cached spans are off the span list. They are kept in their own list by
+ * recency, most recently cached first, linked through their prev/next fields.
+ * Their lastuse is the tick at which they were cached.
+ *
+ *    lcbase ──> newest <──> ... <──> oldest
+ *
+ * The cache holds at most config.lc_maxsz bytes; caching a span past that
+ * evicts the oldest ones. Spans that are not reused within config.lc_ticks
+ * ticks decay, and are unmapped too: the cache is checked on every use, and
+ * every lc_ticks / 2 ticks otherwise, see lcscan().
+ */
+
+/* A cached span serves requests for up to LC_MAXWASTE times fewer bytes. */
+enum {
+    LC_MAXWASTE = 2,
+};
+
+/* Take sp off of the cache list.
+ */
+static void lcsever(struct span *sp) {
+    if (sp->prev)
+        sp->prev->next = sp->next;
+    else
+        heap->lcbase = sp->next;
+    if (sp->next)
+        sp->next->prev = sp->prev;
+    sp->prev = sp->next = 0;
+
+    heap->lc_count--;
+    heap->lc_bytes -= sp->size;
+}
+
+/* The oldest span in the cache.
+ */
+static struct span *lcoldest(void) {
+    struct span *sp = heap->lcbase;
+    while (sp && sp->next)
+        sp = sp->next;
+    return sp;
+}
+
+/* Unmap the oldest span in the cache.
+ */
+static void lcevict(void) {
+    struct span *sp = lcoldest();
+    lcsever(sp);
+    osunmap(sp, sp->size);
+}
+
+/* Unmap the spans that have been in the cache for longer than lc_ticks.
+ */
+static void lcdecay(void) {
+    struct span *sp;
+    while ((sp = lcoldest()) && tick - sp->lastuse > heap->config->lc_ticks) {
+        lcsever(sp);
+        osunmap(sp, sp->size);
+    }
+}
+
+/* Every lc_ticks / 2 ticks, let spans decay, so that a cache nobody asks for
+ * spans does not hold on to them.
+ */
+void lcscan(void) {
+    if (tick < heap->lcscan_next)
+        return;
+    heap->lcscan_next = tick + usz_max(heap->config->lc_ticks / 2, 1);
+    lcdecay();
+}
+
+/* Cache empty span sp, which must be off the span list. Return false if it
+ * does not belong in the cache, in which case the caller unmaps it.
+ */
+b32 lcput(struct span *sp) {
+    if (sp->size < heap->config->lc_minsz || sp->size > heap->config->lc_maxsz)
+        return 0;
+
+    lcdecay();
+    while (heap->lc_bytes + sp->size > heap->config->lc_maxsz)
+        lcevict();
+
+    sp->lastuse = tick;
+    sp->prev = 0;
+    sp->next = heap->lcbase;
+    if (sp->next)
+        sp->next->prev = sp;
+    heap->lcbase = sp;
+
+    heap->lc_count++;
+    heap->lc_bytes += sp->size;
+    return 1;
+}
+
+/* Take the smallest cached span of at least spsz bytes out of the cache, or
+ * return 0. Spans more than LC_MAXWASTE times larger are left for bigger
+ * requests.
+ */
+struct span *lctake(usz spsz) {
+    if (!heap->lcbase)
+        return 0;
+    lcdecay();
+
+    struct span *best = 0;
+    for (struct span *sp = heap->lcbase; sp; sp = sp->next) {
+        if (sp->size < spsz || sp->size / LC_MAXWASTE > spsz)
+            continue;
+        if (!best || sp->size < best->size)
+            best = sp;
+    }
+    if (best)
+        lcsever(best);
+    return best;
+}
+
+/* Unmap every span in the cache.
+ */
+void lcflush(void) {
+    while (heap->lcbase)
+        lcevict();
+}
@@ -0,0 +1,213 @@
+#include "internal.h"
+
+/* With leak_every set, malloc() follows one in leak_sample allocations to
+ * find the call sites that leak. Every leak_every calls to malloc(),
+ * calloc(), realloc() or free() it takes a profile of the bytes live in
+ * sampled allocations from each call site, and compares it to the last one. A
+ * site whose bytes grew in each of the last leak_runs profiles is reported to
+ * LEAK_PATH followed by the pid, and reported again every leak_runs profiles
+ * for as long as it keeps growing:
+ *
+ *    profile 12: site 0x5581f0a2c3b1 grew 8 times to 4194304 bytes (+3145728)
+ *
+ * Sizes are estimates, the sampled bytes times leak_sample; the growth is
+ * since the site started growing. m_leak_report() writes a line for every
+ * site that grew in the last profile, however short its run.
+ *
+ * Sampled allocations are kept in a side table from pointer to site and
+ * usable bytes, see ptab.c. Sites are kept in a table of LEAK_NSITES, probed
+ * LEAK_PROBES slots from their hash; a site that finds no room goes
+ * unsampled. Nothing here allocates from the heap: tables are mapped on their
+ * own and reports are formatted into a static buffer and written with
+ * write(2).
+ */
+
+enum {
+    LEAK_NSITES = 1024,         /* power of 2 */
+    LEAK_PROBES = 8,
+    LEAK_BUFSZ = 4096,
+    LEAK_LINESZ = 128,          /* longest line */
+};
+
+struct lksite {
+    uptr pc;                    /* 0 when the slot is free */
+    usz live;                   /* sampled bytes live */
+    usz prev;                   /* sampled bytes live at the last profile */
+    usz from;                   /* sampled bytes live when it started growing */
+    u64 runs;                   /* profiles it grew in, in a row */
+};
+
+/* Live sampled allocations, each with its site in a and usable bytes in b. */
+struct ptab lktab;
+
+static struct lksite lksites[LEAK_NSITES];
+static usz lksampled = 0;
+static u64 lkcalls = 0;
+static u64 lkprofiles = 0;
+static char lkbuf[LEAK_BUFSZ];
+static usz lklen = 0;
+static int lkfd = -1;
+static char lkpath[sizeof(LEAK_PATH) + 20];
+
+static void lkflush(void) {
+    if (lkfd < 0) {
+        ospidpath(lkpath, LEAK_PATH);
+        lkfd = oscreate(lkpath);
+    }
+    if (lkfd >= 0 && lklen)
+        oswrite(lkfd, lkbuf, lklen);
+    lklen = 0;
+}
+
+static void lkputs(const char *s) {
+    while (*s)
+        lkbuf[lklen++] = *s++;
+}
+
+static void lkputu(u64 x, u32 base) {
+    char digits[20];
+    int n = 0;
+    for (; x || !n; x /= base)
+        digits[n++] = "0123456789abcdef"[x % base];
+    while (n)
+        lkbuf[lklen++] = digits[--n];
+}
+
+static void lkline(struct lksite *st) {
+    if (lklen + LEAK_LINESZ > LEAK_BUFSZ)
+        lkflush();
+    lkputs("profile ");
+    lkputu(lkprofiles, 10);
+    lkputs(": site 0x");
+    lkputu(st->pc, 16);
+    lkputs(" grew ");
+    lkputu(st->runs, 10);
+    lkputs(" times to ");
+    lkputu((u64)st->live * config.leak_sample, 10);
+    lkputs(" bytes (+");
+    lkputu((u64)(st->live - st->from) * config.leak_sample, 10);
+    lkputs(")\n");
+}
+
+/* The slot of the site at pc, or -1 if the table has no room for it.
+ */
+static int lksiteof(void *pc) {
+    u32 h = (u32)(((uptr)pc * 0x9e3779b97f4a7c15ull) >> 32);
+    for (u32 i = 0; i < LEAK_PROBES; i++) {
+        u32 s = (h + i) & (LEAK_NSITES - 1);
+        if (lksites[s].pc == (uptr)pc)
+            return s;
+        if (!lksites[s].pc) {
+            lksites[s].pc = (uptr)pc;
+            return s;
+        }
+    }
+    return -1;
+}
+
+/* Compare the live bytes of each site to the last profile, and report the
+ * sites that have grown for a multiple of leak_runs profiles.
+ */
+static void leakprofile(void) {
+    lkprofiles++;
+    for (u32 i = 0; i < LEAK_NSITES; i++) {
+        struct lksite *st = &lksites[i];
+        if (!st->pc)
+            continue;
+        if (st->live > st->prev) {
+            if (!st->runs++)
+                st->from = st->prev;
+        } else {
+            st->runs = 0;
+        }
+        st->prev = st->live;
+        if (st->runs && config.leak_runs && st->runs % config.leak_runs == 0)
+            lkline(st);
+    }
+    if (lklen)
+        lkflush();
+}
+
+/* Count a call, and take a profile if it is one in leak_every.
+ */
+void leaktick(void) {
+    if (++lkcalls % config.leak_every == 0)
+        leakprofile();
+}
+
+/* Sample p, just allocated by the call site at pc, if it is one in
+ * leak_sample.
+ */
+void leaksample(void *p, void *pc) {
+    if (++lksampled < config.leak_sample)
+        return;
+    lksampled = 0;
+
+    int s = lksiteof(pc);
+    if (s < 0)
+        return;
+    struct ptslot *sl = ptput(&lktab, p);
+    if (!sl)
+        return;
+    sl->a = s;
+    sl->b = (u32)usz_min(plusable(p), UINT32_MAX);
+    lksites[s].live += sl->b;
+}
+
+/* Stop following p, which is being freed, if it is sampled.
+ */
+void leakdrop(void *p) {
+    struct ptslot *sl = ptget(&lktab, p);
+    if (!sl)
+        return;
+    lksites[sl->a].live -= sl->b;
+    ptdel(&lktab, sl);
+}
+
+/* Follow q, which p was reallocated to, instead of p. It stays with the site
+ * that allocated p.
+ */
+void leakmove(void *q, void *p) {
+    struct ptslot *sl = ptget(&lktab, p);
+    if (!sl)
+        return;
+    u32 s = sl->a;
+    lksites[s].live -= sl->b;
+    ptdel(&lktab, sl);
+
+    if (!(sl = ptput(&lktab, q)))
+        return;
+    sl->a = s;
+    sl->b = (u32)usz_min(plusable(q), UINT32_MAX);
+    lksites[s].live += sl->b;
+}
+
+/* Write a line for every site that grew in the last profile.
+ */
+void m_leak_report(void) {
+    for (u32 i = 0; i < LEAK_NSITES; i++) {
+        if (lksites[i].runs)
+            lkline(&lksites[i]);
+    }
+    lkflush();
+}
+
+/* Close the file, at exit or when a test is done with it.
+ */
+__attribute__((destructor))
+void leakfini(void) {
+    if (lkfd < 0)
+        return;
+    osclose(lkfd);
+    lkfd = -1;
+}
+
+/* In a child after fork(2), leave the file of the parent alone; the child
+ * reports to a file of its own.
+ */
+void leakfork(void) {
+    lklen = 0;
+    if (lkfd >= 0)
+        osclose(lkfd);
+    lkfd = -1;
+}
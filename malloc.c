@@ -1,6 +1,5 @@
 #include <assert.h>
 #include <unistd.h> /* sysconf */
-#include <sys/mman.h> /* mmap */
 #include <string.h> /* memset, memcpy */
 
 #include "malloc.h"
@@ -28,7 +27,7 @@
  * │struct span             │ ───┐
  * ├────────────────────────┤    │ sp->free_list
  * │struct block (free)     │ <──┘
- * ├────────────────────────┤ ───┐ bp->next
+ * ├────────────────────────┤ ───┐ blknext(bp)
  * │                        │    │
  * │                        │    │
  * │[footer: block size]    │    │
@@ -55,19 +54,25 @@ void *align_ptr(void *p) {
 }
 */
 
-/* The initial state, when no pages have been requested from the OS, is that
- * the global base pointer is NULL. When the first request comes, the initial
- * span is tracked by this pointer.
- */
-struct span *base = 0;
-
 /* The page size is requested and stored here upon the first call to malloc().
  */
 int pagesize = 0;
 
-/* The number of spans in the list.
+/* The activity clock of the spans, see sptouch().
+ */
+u64 tick = 0;
+
+/* Counters of the calls made through the API, see statalloc().
+ */
+struct stats stats = { 0 };
+
+/* The number of forks in cow mode between the first process and this one.
+ */
+u32 forkgen = 0;
+
+/* Spans inherited from the parents of this process in cow mode, see spfork().
  */
-int span_count = 0;
+struct span *forkbase = 0;
 
 /* Get a pointer to the first block header after a span header, considering
  * padding.
@@ -80,47 +85,77 @@ struct block *spfirstblk(struct span *sp) {
  * well as a span header.
  */
 struct span *spalloc(usz gross) {
+    return spallocgrow(gross, 0);
+}
+
+/* Like spalloc(), for an allocation that has had to move n times to grow.
+ * With va_headroom set and n not 0, address space is reserved after the span
+ * for it to grow into without moving, see spgrow(): the size of the span
+ * times 2^n, up to va_headroom. Allocations that keep outgrowing their
+ * headroom get more of it each time.
+ */
+struct span *spallocgrow(usz gross, u32 n) {
     /* mmap obtains memory in multiples of the page size, padding up the
      * requested size if necessary. Therefore it's in our best interest to
      * round up the request to a page boundary as well, to get that extra
      * memory to ourselves.
      *
      * To minimize system calls for small allocations, a minimum allocation
-     * size of MIN_MMAPSZ is requested.
+     * size of config.span_minsz (MIN_MMAPSZ by default) is requested.
      */
-    usz spsz = usz_max(gross + (usz)SPAN_HDR_PADSZ, MIN_MMAPSZ);
+    usz spsz = usz_max(gross + (usz)SPAN_HDR_PADSZ, heap->config->span_minsz);
     spsz = ALIGN_UP(spsz, pagesize);
 
-    /* mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
-     */
-    struct span *sp = mmap(0, spsz, PROT_WRITE | PROT_READ,
-        MAP_ANON | MAP_PRIVATE, -1, 0);
-
-    if (sp == MAP_FAILED)
+    /* Free list links could not reach the end of a larger span. */
+    if (spsz > SPAN_MAXSZ)
         return 0;
-    span_count++;
 
-    sp->size = spsz;
+    usz room = 0;
+    if (n && heap->config->va_headroom) {
+        room = usz_min(spsz << usz_min(n, 6), heap->config->va_headroom);
+        room = usz_min(room & ~((usz)pagesize - 1), SPAN_MAXSZ - spsz);
+    }
+
+    /* A cached span has its pages mapped already, but they are not zero. */
+    struct span *sp = room ? osreserve(spsz, room) : lctake(spsz);
+    b32 fresh = room || sp == 0;
+    if (!sp) {
+        room = 0;
+        sp = osmap(spsz);
+        if (sp == 0)
+            return 0;
+    }
+    if (fresh)
+        sp->size = spsz;
+    heap->span_count++;
+
+    sp->headroom = room / pagesize;
+    sp->ngrow = n;
     sp->blkcount = 0;
-    sp->next = base;    /* Prepend the span to the list. */
+    sp->flags = forkgen << SPAN_GENSHIFT;
+    sp->heap = heap;
+    sptouch(sp);
+    sp->next = heap->base;    /* Prepend the span to the list. */
     if (sp->next)
         sp->next->prev = sp;
-    base = sp;
+    heap->base = sp;
 
     /* Place one all-spanning free block immediately after the span header. */
-    usz size = spsz - (usz)SPAN_HDR_PADSZ;
+    usz size = sp->size - (usz)SPAN_HDR_PADSZ;
     sp->free_list = blkinitfree(spfirstblk(sp), sp, size);
+    if (fresh)
+        blksetzeroed(sp->free_list);     /* mmap(2) hands out zeroed pages */
     return sp;
 }
 
 /* Remove sp from the list of spans.
  */
 void spsever(struct span *sp) {
-    if (sp == base) {
-        base = sp->next;
+    if (sp == heap->base) {
+        heap->base = sp->next;
         sp->next = 0;
-        if (base)
-            base->prev = 0;
+        if (heap->base)
+            heap->base->prev = 0;
     } else {
         assert(sp->prev);
         sp->prev->next = sp->next;
@@ -131,13 +166,118 @@ void spsever(struct span *sp) {
     }
 }
 
+/* Unmap sp along with its headroom.
+ */
+static void spunmap(struct span *sp) {
+    if (sp->headroom)
+        osunreserve(sp, sp->size, (usz)sp->headroom * pagesize);
+    else
+        osunmap(sp, sp->size);
+}
+
 /* Return an entire span to the OS.
  * XXX return the value from munmap?
  */
 void spfree(struct span *sp) {
-    span_count--;
+    heap->span_count--;
+    spsever(sp);
+    spunmap(sp);
+}
+
+/* Let go of empty span sp: keep it in the large object cache if it is large,
+ * and return it to the OS otherwise. Spans with headroom are not cached.
+ */
+void spretire(struct span *sp) {
+    heap->span_count--;
     spsever(sp);
-    munmap(sp, sp->size);
+    if (sp->headroom || !lcput(sp))
+        spunmap(sp);
+}
+
+/* Commit more of the headroom of sp so that in-use block bp can grow to hold
+ * size bytes, and give it to the last block of sp: the free block after bp,
+ * or a new one if bp is last. At least a quarter of the span is committed at
+ * a time, to keep the system calls down for buffers that grow a little at a
+ * time. Return false if bp is followed by other blocks, or the headroom is
+ * too short.
+ */
+b32 spgrow(struct span *sp, struct block *bp, usz size) {
+    struct block *last = blknextadj(bp);
+    if (last && (!blkisfree(last) || blknextadj(last)))
+        return 0;
+
+    usz have = blksize(bp) + (last ? blksize(last) : 0);
+    usz need = blksizerequest(size) - have;
+    usz room = (usz)sp->headroom * pagesize;
+    usz grow = ALIGN_UP(usz_max(need, sp->size / 4), (usz)pagesize);
+    grow = usz_min(grow, room);
+    byte *end = (byte *)sp + sp->size;
+    if (grow < need || !oscommit(end, grow))
+        return 0;
+
+    sp->size += grow;
+    sp->headroom -= grow / pagesize;
+    if (last) {
+        blksetsize(last, blksize(last) + grow);
+        *blkfoot(last) = blksize(last);
+    } else {
+        last = blkinitfree(end, sp, grow);
+        blkprepend(last);
+        blksetprevused(last);
+    }
+    return 1;
+}
+
+/* With cold_ticks set, every cold_ticks / 2 ticks, hint the OS about spans
+ * that have had no block allocated or freed for cold_ticks ticks. Their pages
+ * are marked cold, or paged out if free memory is below cold_freepct. A span
+ * is only hinted once until it is used again.
+ */
+void spcoldscan(void) {
+    if (tick < heap->coldscan_next)
+        return;
+    heap->coldscan_next = tick + usz_max(heap->config->cold_ticks / 2, 1);
+
+    b32 pageout = oslowmem(heap->config->cold_freepct);
+    for (struct span *sp = heap->base; sp; sp = sp->next) {
+        if (sp->flags & SPAN_COLD || tick - sp->lastuse < heap->config->cold_ticks)
+            continue;
+        oscold(sp, sp->size, pageout);
+        sp->flags |= SPAN_COLD;
+    }
+}
+
+/* In the child of a fork in cow mode, let go of the spans of the parent
+ * without writing to them. Their blocks stay allocated for good, so the pages
+ * that hold them and their headers are never copied; new blocks come from new
+ * spans. The inherited spans are kept on forkbase so that their pointers are
+ * still recognized as ours.
+ */
+void spfork(void) {
+    forkgen++;
+    struct heap *cur = heap;
+    for (heap = &defheap; heap; heap = heap->next) {
+        if (heap->base) {
+            struct span *tail = heap->base;
+            while (tail->next)
+                tail = tail->next;
+            tail->next = forkbase;
+            forkbase = heap->base;
+        }
+        heap->base = 0;
+        heap->span_count = 0;
+        lcflush();
+    }
+    heap = cur;
+}
+
+/* Bring the state of a child process in line after fork(2). */
+static void mforkchild(void) {
+    tmfork();
+    snapfork();
+    leakfork();
+    if (config.cow)
+        spfork();
 }
 
 int ptr_in_span(void *p, struct span *sp) {
@@ -150,25 +290,27 @@ int ptr_in_span(void *p, struct span *sp) {
  */
 void blksever(struct block *bp) {
     struct span *sp = bp->owner;
+    struct block *prev = blkprev(bp);
+    struct block *next = blknext(bp);
 
-    if (bp->next) assert(bp->next->prev == bp);
-    if (bp->prev) assert(bp->prev->next == bp);
-    else          assert(sp->free_list == bp);
+    if (next) assert(blkprev(next) == bp);
+    if (prev) assert(blknext(prev) == bp);
+    else      assert(sp->free_list == bp);
 
-    if (!bp->prev) {
+    if (!prev) {
         /* bp is first in the free list. Point the span to whatever is next,
          * and make that the start of the list.
          */
-        sp->free_list = bp->next;
+        sp->free_list = next;
         if (sp->free_list)
-            sp->free_list->prev = 0;
+            blksetprev(sp->free_list, 0);
     } else {
         /* Point the previous block to bp's next block, and vice versa (if
          * there is a next block).
          */
-        bp->prev->next = bp->next;
-        if (bp->next)
-            bp->next->prev = bp->prev;
+        blksetnext(prev, next);
+        if (next)
+            blksetprev(next, prev);
     }
 }
 
@@ -215,6 +357,7 @@ struct block *blkalloc(usz gross, struct block *bp) {
     }
 
     bp->owner->blkcount++;
+    sptouch(bp->owner);
 
     /* Let the next block know its prev neighbor is in use. */
     struct block *bq = blknextadj(bp);
@@ -230,6 +373,7 @@ void blkfree(struct block *bp) {
     struct span *sp = bp->owner;
     assert(sp->blkcount > 0);
     sp->blkcount--;
+    sptouch(sp);
     blkinitfree(bp, sp, blksize(bp));
     blkprepend(bp);
 
@@ -253,12 +397,13 @@ struct block *blkinit(void *p, struct span *sp, usz size) {
 }
 
 /* Initialize a header at location p for a free block with the given size and
- * owner.
+ * owner. Its payload is not assumed to be zeroed.
  */
 struct block *blkinitfree(void *p, struct span *sp, usz size) {
     struct block *bp = blkinit(p, sp, size);
     bp->magic = MAGIC_BABY;
     blksetfree(bp);
+    blksetdirty(bp);
     *blkfoot(bp) = size;
     return bp;
 }
@@ -269,6 +414,7 @@ struct block *blkinitfree(void *p, struct span *sp, usz size) {
 struct block *blkinitused(void *p, struct span *sp, usz size) {
     struct block *bp = blkinit(p, sp, size);
     blksetused(bp);
+    blksetdirty(bp);
     bp->magic = MAGIC_SPENT;
     return bp;
 }
@@ -278,10 +424,11 @@ struct block *blkinitused(void *p, struct span *sp, usz size) {
 void blkprepend(struct block *bp) {
     assert(bp && blkisfree(bp));
     struct span *sp = bp->owner;
-    bp->next = sp->free_list;
+    blksetnext(bp, sp->free_list);
+    blksetprev(bp, 0);
+    if (sp->free_list)
+        blksetprev(sp->free_list, bp);
     sp->free_list = bp;
-    if (bp->next)
-        bp->next->prev = bp;
 }
 
 /* Traverse the free list of each span to find a free block big enough to serve
@@ -289,19 +436,51 @@ void blkprepend(struct block *bp) {
  * the memory.
  */
 struct block *blkfind(usz gross) {
-    struct span *sp = base;
-    while (sp) {
+    return blkfindin(gross, 0);
+}
+
+/* Like blkfind(), in the spans whose SPAN_LONG flag is long only.
+ */
+struct block *blkfindin(usz gross, u32 lng) {
+    for (struct span *sp = heap->base; sp; sp = sp->next) {
+        /* The next header is fetched while this free list is walked. Within
+         * the list there is nothing to gain: the address of the next block
+         * arrives with the header of this one.
+         */
+        __builtin_prefetch(sp->next);
+        if ((sp->flags & SPAN_LONG) != lng)
+            continue;
         struct block *bp = sp->free_list;
         while (bp) {
             if (blksize(bp) >= gross)
                 return bp;
-            bp = bp->next;
+            bp = blknext(bp);
         }
-        sp = sp->next;
     }
     return 0;
 }
 
+/* Find the free block in sp that would place a block of size gross closest to
+ * p. blkalloc() carves new blocks off the end of free blocks.
+ */
+struct block *blkfindnear(struct span *sp, usz gross, void *p) {
+    struct block *best = 0;
+    usz bestd = 0;
+    for (struct block *bp = sp->free_list; bp; bp = blknext(bp)) {
+        if (blksize(bp) < gross)
+            continue;
+        uptr at = (uptr)bp;
+        if (blksize(bp) - gross >= MIN_BLKSZ)
+            at += blksize(bp) - gross;
+        usz d = at > (uptr)p ? at - (uptr)p : (uptr)p - at;
+        if (!best || d < bestd) {
+            best = bp;
+            bestd = d;
+        }
+    }
+    return best;
+}
+
 /* Compute a pointer to the (free) block physically before bp using its footer
  * (hence the need for it to be free). If bp is the first block in the span,
  * return 0.
@@ -323,7 +502,7 @@ struct block *blkprevadj(struct block *bp) {
 }
 
 /* Compute a pointer to the block physically next to bp. If that block is in
- * use, it will not be bp->next. If bp is the last block in its span, return
+ * use, it will not be blknext(bp). If bp is the last block in its span, return
  * 0.
  */
 struct block *blknextadj(struct block *bp) {
@@ -355,6 +534,9 @@ void blkcoalesce(struct block *bp, struct block *bq) {
     usz bsz = blksize(bp) + blksize(bq);
     blksetsize(bp, bsz);
     *blkfoot(bp) = bsz;
+
+    /* bp's old footer and bq's header are payload now. */
+    blksetdirty(bp);
 }
 
 /* Try to coalesce a free block in both directions.
@@ -376,15 +558,129 @@ struct block *coalesce(struct block *bp) {
     return bp;
 }
 
-/* True if p belongs to any of the allocated spans. */
+/* True if p belongs to none of the allocated spans or segments. */
 b32 plforeign(void *p) {
-    for (struct span *s = base; s; s = s->next) {
+    if (pmget(p))
+        return 0;
+    for (struct heap *h = &defheap; h; h = h->next) {
+        for (struct span *s = h->base; s; s = s->next) {
+            if (ptr_in_span(p, s))
+                return 0;
+        }
+    }
+    for (struct span *s = forkbase; s; s = s->next) {
         if (ptr_in_span(p, s))
             return 0;
     }
     return 1;
 }
 
+/* The heap that owns allocation p.
+ */
+struct heap *plheap(void *p) {
+    struct segment *sg = pmget(p);
+    return sg ? sg->heap : plblk(p)->owner->heap;
+}
+
+/* Set up what the allocator needs before serving its first request.
+ */
+void minit(void) {
+    pagesize = sysconf(_SC_PAGESIZE);
+    configinit();
+    if (config.det_base)
+        osdetinit(config.det_base, config.det_size);
+    if (config.tm_ring)
+        tminit();
+    osatfork(mforkchild);
+}
+
+/* The number of bytes the caller can use at p, which may be more than they
+ * asked for.
+ */
+usz plusable(void *p) {
+    struct segment *sg = pmget(p);
+    if (sg)
+        return sg->kind == SEG_BUDDY ? bdsize(sg, p) : phsize(sg, p);
+    return plsize(plblk(p));
+}
+
+/* Account for allocation p of size bytes handed to the caller, and publish it
+ * if telemetry is on. The other two do the same for frees and reallocs. All
+ * three run with heap set to the heap that owns p.
+ */
+static void statalloc(void *p, usz size) {
+    usz usable = plusable(p);
+    stats.nalloc++;
+    stats.live += usable;
+    heap->live += usable;
+    if (tg_current)
+        tgput(p, tg_current, usable);
+    if (tmring)
+        tmrecord(TM_ALLOC, p, 0, size);
+    if (config.snap_every)
+        snaptick();
+    if (config.leak_every)
+        leaktick();
+}
+
+/* True if p is in a span inherited in cow mode, and so is never given back.
+ * Its bytes stay live after it is freed or reallocated away from.
+ */
+static b32 plimmortal(void *p) {
+    return !pmget(p) && spinherited(plblk(p)->owner);
+}
+
+static void statfree(void *p) {
+    usz usable = plusable(p);
+    stats.nfree++;
+    if (!plimmortal(p)) {
+        stats.live -= usable;
+        heap->live -= usable;
+    }
+    if (tgtab.count)
+        tgdrop(p, usable);
+    if (lktab.count)
+        leakdrop(p);
+    if (tmring)
+        tmrecord(TM_FREE, p, 0, 0);
+    if (config.snap_every)
+        snaptick();
+    if (config.leak_every)
+        leaktick();
+}
+
+static void statrealloc(void *q, void *p, usz old, b32 kept, usz size) {
+    usz usable = plusable(q);
+    usz gone = q != p && kept ? 0 : old;
+    stats.nrealloc++;
+    stats.live += usable - gone;
+    heap->live += usable - gone;
+    if (tgtab.count)
+        tgmove(q, p, old, usable);
+    if (lktab.count)
+        leakmove(q, p);
+    if (tmring)
+        tmrecord(TM_REALLOC, q, p, size);
+    if (config.snap_every)
+        snaptick();
+    if (config.leak_every)
+        leaktick();
+}
+
+/* Account for p, if not null, just allocated for size bytes by the caller at
+ * pc, which is call site s.
+ */
+static void *allocdone(void *p, usz size, u32 s, void *pc) {
+    if (p) {
+        statalloc(p, size);
+        if (config.site_ticks)
+            sitesample(p, s);
+        if (config.leak_every)
+            leaksample(p, pc);
+    }
+    return p;
+}
+
 /* Serve a request for memory for the caller. Search for an already mmap'd span
  * with enough available space for the new block: its header, and the number of
  * bytes requested by the user. If one does not exist, a new span is mmap'd and
@@ -397,9 +693,106 @@ b32 plforeign(void *p) {
  * malloc did until GNU grep said "memory exhausted".
  */
 void *m_malloc(usz size) {
-    /* Determine the page size on first call. */
+    return mallocfrom(size, __builtin_return_address(0));
+}
+
+/* m_malloc() on behalf of the caller at pc. With site_ticks set, blocks for
+ * call sites that have been seen to allocate long-lived blocks come from
+ * spans of their own. See site.c. With leak_every set, the allocation may be
+ * sampled for its call site; see leak.c.
+ */
+void *mallocfrom(usz size, void *pc) {
+    u32 s = 0, flags = 0;
+    if (config.site_ticks) {
+        s = siteof(pc);
+        if (sitelong(s))
+            flags |= ALLOC_LONG;
+    }
+    return allocdone(alloc(size, flags), size, s, pc);
+}
+
+/* m_calloc() on behalf of the caller at pc, sampled like mallocfrom().
+ */
+void *callocfrom(usz n, usz s, void *pc) {
+    u32 site = 0, flags = ALLOC_ZERO;
+    if (config.site_ticks) {
+        site = siteof(pc);
+        if (sitelong(site))
+            flags |= ALLOC_LONG;
+    }
+    return allocdone(alloc(n * s, flags), n * s, site, pc);
+}
+
+/* Allocate the block at bp to the caller. Split the free space if possible,
+ * sever the block from the free list, and update block and span metadata.
+ */
+static void *blkserve(struct block *bp, usz gross, b32 zero) {
+    /* A block carved off the end of bp is written by blkalloc() and then,
+     * usually, by the caller; start fetching it while bp is unlinked.
+     */
+    if (blksize(bp) - gross >= MIN_BLKSZ)
+        __builtin_prefetch((byte *)bp + blksize(bp) - gross, 1);
+    b32 zeroed = blkiszeroed(bp);
+    bp = blkalloc(gross, bp);
+    if (heap->config->cold_ticks)
+        spcoldscan();
+    if (heap->lcbase)
+        lcscan();
+
+    /* The caller's memory comes after the block header, which is padded to
+     * ALIGNMENT bytes to ensure the memory itself is aligned. The memory is
+     * extended to a multiple of ALIGNMENT too, to ensure any subsequent
+     * block header is automatically aligned.
+     */
+    void *p = blkpayload(bp);
+
+    /* Out of a zeroed free block, only the old footer at the end is dirty. */
+    if (zero && zeroed)
+        *blkfoot(bp) = 0;
+    else if (zero)
+        memset(p, 0, plsize(bp));
+    return p;
+}
+
+/* Allocate size bytes for an allocation that has had to move n times to grow.
+ * Large ones get a span of their own with headroom, see spallocgrow().
+ */
+static void *allocgrow(usz size, u32 n) {
+    usz gross = blksizerequest(size);
+    if (phserves(size) || bdserves(size)
+        || gross + SPAN_HDR_PADSZ <= heap->config->span_minsz)
+        return alloc(size, 0);
+
+    struct span *sp = spallocgrow(gross, n);
+    if (!sp)
+        return 0;
+    return blkserve(sp->free_list, gross, 0);
+}
+
+/* The implementation of m_malloc() and m_calloc(). With ALLOC_ZERO, the memory
+ * returned is zeroed out, but only the bytes not already known to be zero are
+ * written: the page heap keeps fresh and purged runs apart for this, and a
+ * block carved from a zeroed free block only needs its last word cleared.
+ * With ALLOC_LONG, a block comes from the spans for long-lived blocks.
+ */
+void *alloc(usz size, u32 flags) {
+    b32 zero = flags & ALLOC_ZERO;
+
+    /* Determine the page size and read the knobs on first call. */
     if (pagesize == 0)
-        pagesize = sysconf(_SC_PAGESIZE);
+        minit();
+
+    /* Medium requests are served in whole pages by the page heap, or by the
+     * buddy arenas if that is the backend.
+     */
+    if (phserves(size))
+        return phalloc(size, zero);
+    if (bdserves(size)) {
+        void *p = bdalloc(size);
+        if (p && zero)
+            memset(p, 0, bdgoodsize(size));
+        return p;
+    }
 
     /* Calculate how many bytes are needed to hold the requested memory along
      * with padding and metadata.
@@ -408,7 +801,8 @@ void *m_malloc(usz size) {
     assert(gross >= MIN_BLKSZ);
 
     /* Try to find a block with enough space to serve the request. */
-    struct block *bp = blkfind(gross);
+    u32 lng = flags & ALLOC_LONG ? SPAN_LONG : 0;
+    struct block *bp = blkfindin(gross, lng);
 
     /* If no existing span has enough space to serve the request, or if there
      * is no existing span because this is the first call, a new span needs to
@@ -418,23 +812,40 @@ void *m_malloc(usz size) {
         struct span *sp = spalloc(gross);
         if (sp == 0)     /* mmap(2) failed, not my fault */
             return 0;
+        sp->flags |= lng;
 
         /* The fresh span has a single free block the size of the entire span. */
         bp = sp->free_list;
     }
 
-    /* Allocate the block at bp to the caller. Split the free space if
-     * possible, sever the block from the free list, and update block and span
-     * metadata.
-     */
-    bp = blkalloc(gross, bp);
+    return blkserve(bp, gross, zero);
+}
 
-    /* The caller's memory comes after the block header, which is padded to
-     * ALIGNMENT bytes to ensure the memory itself is aligned. The memory is
-     * extended to a multiple of ALIGNMENT too, to ensure any subsequent
-     * block header is automatically aligned.
-     */
-    return blkpayload(bp);
+/* Allocate size bytes as close to hint, a live allocation, as there is room
+ * for in its span, so that linked nodes share pages and cache lines. Requests
+ * that don't go to spans, those that don't fit in the span of hint, and those
+ * from a call site whose blocks live longer or shorter than the span's are
+ * served as by m_malloc().
+ */
+void *m_malloc_near(void *hint, usz size) {
+    void *pc = __builtin_return_address(0);
+    u32 s = 0, lng = 0;
+    if (config.site_ticks) {
+        s = siteof(pc);
+        if (sitelong(s))
+            lng = SPAN_LONG;
+    }
+
+    struct block *bp = 0;
+    usz gross = blksizerequest(size);
+    if (hint && pagesize && !phserves(size) && !bdserves(size) && !pmget(hint)) {
+        struct span *sp = plblk(hint)->owner;
+        if (!spinherited(sp) && (sp->flags & SPAN_LONG) == lng)
+            bp = blkfindnear(sp, gross, hint);
+    }
+    if (!bp)
+        return mallocfrom(size, pc);
+    return allocdone(blkserve(bp, gross, 0), size, s, pc);
 }
 
 /* Give back a block of memory to its span.
@@ -442,14 +853,40 @@ void *m_malloc(usz size) {
 void m_free(void *p) {
     if (!p)
         return;
+    struct heap *cur = heap;
+    heap = plheap(p);
+    statfree(p);
+    dealloc(p);
+    heap = cur;
+}
+
+/* The implementation of m_free(), for a p that is not null.
+ */
+void dealloc(void *p) {
+    struct segment *sg = pmget(p);
+    if (sg) {
+        if (sg->kind == SEG_BUDDY)
+            bdfree(sg, p);
+        else
+            phfree(sg, p);
+        return;
+    }
 
     struct block *bp = plblk(p);
     assert(!blkisfree(bp));
+    if (spinherited(bp->owner))
+        return;
+    if (bp->next)
+        sitefree(bp);
     blkfree(bp);
+    if (heap->config->cold_ticks)
+        spcoldscan();
+    if (heap->lcbase)
+        lcscan();
 
     struct span *sp = bp->owner;
-    if (sp->blkcount == 0 && span_count > SPAN_CACHE) {
-        spfree(sp);
+    if (sp->blkcount == 0 && heap->span_count > SPAN_CACHE) {
+        spretire(sp);
         return;
     }
 
@@ -461,17 +898,52 @@ void m_free(void *p) {
     memset(p, POISON_BYTE, plsize(bp) - sizeof(usz));
 }
 
+/* The usable size of a request for size bytes, following the same path as
+ * m_malloc(). A block may end up a little larger when the space left after
+ * splitting is too small for another block; that is not counted.
+ */
+usz goodsize(usz size) {
+    if (phserves(size))
+        return ALIGN_UP(usz_max(size, 1), (usz)pagesize);
+    if (bdserves(size))
+        return bdgoodsize(size);
+    return blksizerequest(size) - BLOCK_HDR_PADSZ;
+}
+
+/* Return how many bytes a request for size bytes would get without making
+ * it, so callers can use all of it. With M_ALIGN(a) in flags, return the
+ * usable size of the smallest request of at least size bytes that is certain
+ * to be aligned to a, which may be larger than size. Page heap runs start on a
+ * page boundary and buddy blocks are aligned to their own size, so which
+ * alignments can be had depends on the backend. Return 0 if none can.
+ */
+usz m_good_size(usz size, int flags) {
+    if (pagesize == 0)
+        minit();
+
+    usz align = (usz)1 << (flags & M_LG_ALIGN_MASK);
+    if (align <= ALIGNMENT)
+        return goodsize(size);
+
+    usz n;
+    if (heap->config->backend == BACKEND_BUDDY) {
+        n = usz_max(usz_max(size, align), heap->config->bd_minsz);
+        if (bdserves(n))
+            return bdgoodsize(n);
+    }
+    if (heap->config->backend == BACKEND_PAGES && align <= (usz)pagesize) {
+        n = usz_max(size, heap->config->ph_minsz);
+        if (phserves(n))
+            return goodsize(n);
+    }
+    return 0;
+}
+
 /* Allocate enough contiguous space for n elements of size s bytes each. The
  * allocated memory is zeroed out.
  */
 void *m_calloc(usz n, usz s) {
-    s *= n;
-    void *p = m_malloc(s);
-    if (!p)
-        return 0;
-    struct block *bp = plblk(p);
-    memset(p, 0, plsize(bp));
-    return p;
+    return callocfrom(n, s, __builtin_return_address(0));
 }
 
 /* Try to change the size of allocation p to size, and return p. If size is
@@ -493,12 +965,41 @@ void *m_realloc(void *p, usz size) {
     if (!p)
         return m_malloc(size);
 
+    struct heap *cur = heap;
+    heap = plheap(p);
+    usz old = plusable(p);
+    b32 kept = plimmortal(p);
+    void *q = reallocate(p, size);
+    if (q)
+        statrealloc(q, p, old, kept, size);
+    heap = cur;
+    return q;
+}
+
+/* The implementation of m_realloc(), for a p that is not null.
+ */
+void *reallocate(void *p, usz size) {
+    struct segment *sg = pmget(p);
+    if (sg) {
+        if (sg->kind == SEG_BUDDY)
+            return bdrealloc(sg, p, size);
+        return phrealloc(sg, p, size);
+    }
+
     struct block *bp = plblk(p);
     usz gross = blksizerequest(size);
 
     if (gross == blksize(bp))
         return p;
 
+    /* Copy out of an inherited span, leaving p where it is. */
+    if (spinherited(bp->owner)) {
+        void *q = alloc(size, 0);
+        if (q)
+            memcpy(q, p, plsize(bp) < size ? plsize(bp) : size);
+        return q;
+    }
+
     if (!size || gross < blksize(bp))
         return realloc_truncate(bp, size);
 
@@ -533,57 +1034,226 @@ void *realloc_truncate(struct block *bp, usz size) {
         bp = coalesce(bp);
     }
 
+    /* A large shrink should actually give memory back. */
+    if (blksize(bp) >= TRIM_MINSZ)
+        blktrim(bp);
+
     /* p still points to the original payload, now truncated. */
     return p;
 }
 
-void *realloc_extend(struct block *bp, usz size) {
+/* Return the pages of free block bp to the OS. If bp is the last block of its
+ * span, the span is shrunk with mremap(2) to end at the first page boundary
+ * that leaves room for a minimum block, which keeps whatever remains of bp;
+ * a span with headroom decommits the pages instead, adding them back to its
+ * headroom so that it can grow back. Otherwise the pages between bp's header
+ * and footer are purged; they stay mapped and read back as zeroes.
+ *
+ *  [    in use    ][    bp    |    |    |    |  ]
+ *                          ^ keep        released ^
+ */
+void blktrim(struct block *bp) {
+    assert(bp && blkisfree(bp));
+    struct span *sp = bp->owner;
+    uptr start = (uptr)bp - (uptr)sp;
+
+    if (!blknextadj(bp)) {
+        usz keep = ALIGN_UP(start, (usz)pagesize);
+        if (keep != start && keep - start < MIN_BLKSZ)
+            keep += pagesize;
+        if (keep >= sp->size)
+            return;
+        if (sp->headroom) {
+            if (!osdecommit((byte *)sp + keep, sp->size - keep))
+                return;
+            sp->headroom += (sp->size - keep) / pagesize;
+        } else if (!osshrink(sp, sp->size, keep)) {
+            return;
+        }
+
+        blksever(bp);
+        sp->size = keep;
+        if (keep != start) {
+            bp = blkinitfree(bp, sp, keep - start);
+            blkprepend(bp);
+        }
+        return;
+    }
+
+    uptr lo = ALIGN_UP((uptr)bp + BLOCK_HDR_PADSZ, (uptr)pagesize);
+    uptr hi = (uptr)blkfoot(bp) & ~((uptr)pagesize - 1);
+    if (hi > lo)
+        ospurge((void *)lo, hi - lo);
+}
+
+/* Extend in-use block bp in place to hold size bytes, by absorbing the free
+ * block physically after it. Return false if there is no such block or it is
+ * too small.
+ */
+b32 blkextend(struct block *bp, usz size) {
     assert(bp && !blkisfree(bp));
 
     usz gross = blksizerequest(size);
     assert(blksize(bp) < gross);
 
-    void *p = blkpayload(bp);
     struct block *bq = blknextadj(bp);
 
     usz diff = bq && blkisfree(bq) ? gross - blksize(bp) : 0;
-    if (bq && blkisfree(bq) && blksize(bq) >= diff) {
-        /* Extend bp over bq, splitting if there's enough space left.
-         *
-         * [    bp     ][   bq   ]
-         *  ------ gross ------## <- leftover
-         */
-        usz leftover = blksize(bp) + blksize(bq) - gross;
-        assert_aligned(leftover, ALIGNMENT);
-
-        if (leftover < MIN_BLKSZ) {
-            blksever(bq);
-            blksetsize(bp, blksize(bp) + blksize(bq)); /* Take all the space. */
-            bq = blknextadj(bq);
-            if (bq)
-                blksetprevused(bq);
-            return p;
-        }
+    if (!bq || !blkisfree(bq) || blksize(bq) < diff)
+        return 0;
 
-        /* Extend bp and split bq. No need to coalesce--bq is already free. */
-        blksetsize(bp, gross);
+    /* Extend bp over bq, splitting if there's enough space left.
+     *
+     * [    bp     ][   bq   ]
+     *  ------ gross ------## <- leftover
+     */
+    usz leftover = blksize(bp) + blksize(bq) - gross;
+    assert_aligned(leftover, ALIGNMENT);
 
-        byte *nb = (byte *)bp + gross;
+    if (leftover < MIN_BLKSZ) {
         blksever(bq);
-        bq = blkinitfree(nb, bp->owner, leftover);
-        blkprepend(bq);
-        blksetprevused(bq);
+        blksetsize(bp, blksize(bp) + blksize(bq)); /* Take all the space. */
+        bq = blknextadj(bq);
+        if (bq)
+            blksetprevused(bq);
+        return 1;
+    }
+
+    /* Extend bp and split bq. No need to coalesce--bq is already free. */
+    blksetsize(bp, gross);
+
+    byte *nb = (byte *)bp + gross;
+    blksever(bq);
+    bq = blkinitfree(nb, bp->owner, leftover);
+    blkprepend(bq);
+    blksetprevused(bq);
+
+    return 1;
+}
 
+void *realloc_extend(struct block *bp, usz size) {
+    void *p = blkpayload(bp);
+    if (blkextend(bp, size))
+        return p;
+
+    struct span *sp = bp->owner;
+    if (sp->headroom && spgrow(sp, bp, size) && blkextend(bp, size))
         return p;
-    }
 
     /* Make a new allocation and move the entire payload. */
-    void *q = m_malloc(size);
+    void *q = heap->config->va_headroom ? allocgrow(size, sp->ngrow + 1)
+        : alloc(size, 0);
     if (!q)
         return 0;
 
     memcpy(q, p, plsize(bp));
-    m_free(p);
+    dealloc(p);
 
     return q;
 }
+
+/* Resize the allocation at p in place to hold size bytes, whichever backend
+ * it belongs to. Shrinking always works; return false if p can't grow.
+ */
+b32 plresize(void *p, usz size) {
+    struct segment *sg = pmget(p);
+    if (sg) {
+        if (sg->kind == SEG_BUDDY)
+            return bdresize(sg, p, size);
+        return phresize(sg, p, size);
+    }
+
+    /* An inherited block keeps its size, which is enough for a shrink. */
+    struct block *bp = plblk(p);
+    if (spinherited(bp->owner))
+        return blksizerequest(size) <= blksize(bp);
+    if (blksizerequest(size) <= blksize(bp)) {
+        realloc_truncate(bp, size);
+        return 1;
+    }
+    if (blkextend(bp, size))
+        return 1;
+    return bp->owner->headroom && spgrow(bp->owner, bp, size)
+        && blkextend(bp, size);
+}
+
+/* Resize allocation p without ever moving it, for callers that would rather
+ * move their data themselves than have realloc() copy bytes. If max is less
+ * than the usable size of p, p is shrunk to max. Otherwise p is grown to hold
+ * max bytes if there is room behind it, or failing that, min bytes. Return the
+ * usable size of p afterwards, which may be less than min if p could not grow,
+ * or 0 if p is null.
+ */
+usz m_expand(void *p, usz min, usz max) {
+    if (!p)
+        return 0;
+    struct heap *h = heap;
+    heap = plheap(p);
+    usz cur = plusable(p);
+    if (max < min)
+        max = min;
+
+    if (max < cur)
+        plresize(p, max);
+    else if (max > cur && !plresize(p, max) && min > cur)
+        plresize(p, min);
+
+    usz usable = plusable(p);
+    stats.live += usable - cur;
+    heap->live += usable - cur;
+    if (tgtab.count)
+        tgmove(p, p, cur, usable);
+    if (lktab.count)
+        leakmove(p, p);
+    heap = h;
+    return usable;
+}
+
+/* Allocate size bytes counted against tag, whatever the current tag is.
+ */
+void *m_malloc_tagged(usz size, unsigned tag) {
+    u32 cur = tg_current;
+    tg_current = tag;
+    void *p = mallocfrom(size, __builtin_return_address(0));
+    tg_current = cur;
+    return p;
+}
+
+/* Tag the allocations that follow made by the calling thread. Other threads
+ * keep their own tags.
+ */
+unsigned m_set_tag(unsigned tag) {
+    u32 cur = tg_current;
+    tg_current = tag;
+    return cur;
+}
+
+/* Read the bytes and allocations live under tag.
+ */
+void m_tag_stats(unsigned tag, struct m_tag_stats *s) {
+    struct m_tag_stats none = { 0, 0 };
+    *s = tag < M_NTAGS ? tgstats[tag] : none;
+}
+
+/* Tell how full the span or segment that holds p is, and the heap as a whole,
+ * so the caller can move objects out of sparse spans until they are empty and
+ * unmapped. A span counts the bytes of its blocks, headers included, and a
+ * segment the bytes of its pages, past the header in both cases. The heap
+ * counts the usable bytes handed out against the bytes mapped.
+ */
+void m_utilization(void *p, struct m_utilization *u) {
+    struct segment *sg = pmget(p);
+    if (sg) {
+        u->used = (usz)sg->nused * pagesize;
+        u->size = (usz)(sg->npages - sg->hdrpages) * pagesize;
+    } else {
+        struct span *sp = plblk(p)->owner;
+        usz avail = 0;
+        for (struct block *bp = sp->free_list; bp; bp = blknext(bp))
+            avail += blksize(bp);
+        u->size = sp->size - SPAN_HDR_PADSZ;
+        u->used = u->size - avail;
+    }
+    u->heap_used = stats.live;
+    u->heap_size = stats.mapped;
+}
@@ -14,8 +14,8 @@
 
 enum {
     ALIGNMENT = 16,
-    MIN_BLKSZ = 64,     /* (?) This ought to at least be bigger than the
-                         * header. */
+    MIN_BLKSZ = 48,     /* Room for the header and the footer of a free
+                         * block. */
     MIN_MMAPSZ = 64 * 1024,
 };
 
@@ -36,4 +36,94 @@ void *m_calloc(size_t n, size_t s);
 void *m_realloc(void *p, size_t size);
 void m_free(void *p);
 
+/* Allocate n bytes as close to hint, a live allocation, as there is room for.
+ */
+void *m_malloc_near(void *hint, size_t n);
+
+/* Resize p in place to hold between min and max bytes, never moving it.
+ * Return the usable size of p afterwards, or 0 if p is null.
+ */
+size_t m_expand(void *p, size_t min, size_t max);
+
+/* Flags for m_good_size(). M_ALIGN(a) asks for alignment to a, a power of 2.
+ */
+#define M_LG_ALIGN(la)      ((int)(la))
+#define M_ALIGN(a)          M_LG_ALIGN(__builtin_ctzll(a))
+#define M_LG_ALIGN_MASK     0x3f
+
+/* The usable size a request for size bytes would get, without allocating.
+ */
+size_t m_good_size(size_t size, int flags);
+
+/* How full the span or segment holding an allocation is, and the heap.
+ */
+struct m_utilization {
+    size_t used;            /* bytes in use in the span or segment */
+    size_t size;            /* bytes in the span or segment */
+    size_t heap_used;       /* bytes handed out in the whole heap */
+    size_t heap_size;       /* bytes mapped for the whole heap */
+};
+
+void m_utilization(void *p, struct m_utilization *u);
+
+/* Allocator instances with knobs of their own, given as in BABY_MALLOC_CONF.
+ * m_free() and m_realloc() take pointers from any of them.
+ */
+struct m_heap;
+
+struct m_heap *m_heap_create(const char *conf);
+void m_heap_destroy(struct m_heap *h);
+void *m_heap_malloc(struct m_heap *h, size_t n);
+void *m_heap_calloc(struct m_heap *h, size_t n, size_t s);
+
+/* Tagged accounting: allocations can carry a tag from 1 to M_NTAGS - 1, and
+ * the bytes and allocations live under each tag are kept.
+ */
+enum {
+    M_NTAGS = 256,
+};
+
+struct m_tag_stats {
+    size_t bytes;           /* usable bytes live under the tag */
+    size_t count;           /* allocations live under the tag */
+};
+
+/* Allocate with the given tag. */
+void *m_malloc_tagged(size_t size, unsigned tag);
+
+/* Set the tag of m_malloc(), m_calloc() and new m_realloc() allocations made
+ * by the calling thread, 0 for none. Return the previous one.
+ */
+unsigned m_set_tag(unsigned tag);
+
+void m_tag_stats(unsigned tag, struct m_tag_stats *s);
+
+/* With leak_every set, write the call sites whose sampled live bytes grew in
+ * the last profile to the leak report.
+ */
+void m_leak_report(void);
+
+/* Counters of allocator activity, pools included, summed over all threads. */
+struct m_stats {
+    size_t nalloc;          /* allocations made */
+    size_t nfree;           /* frees of non-null pointers */
+    size_t nrealloc;        /* reallocs of non-null pointers */
+    size_t live;            /* usable bytes handed out and not freed */
+    size_t mapped;          /* bytes mapped from the OS */
+    size_t nsys;            /* system calls made for memory */
+};
+
+void m_stats(struct m_stats *s);
+
+/* Pools of objects of one size, for any number of threads at once, without
+ * locks. Objects from a pool go back to it with m_pool_free(), not m_free().
+ * A process can create up to 16 pools over its lifetime.
+ */
+struct m_pool;
+
+struct m_pool *m_pool_create(size_t size);
+void m_pool_destroy(struct m_pool *pl);
+void *m_pool_alloc(struct m_pool *pl);
+void m_pool_free(struct m_pool *pl, void *p);
+
 #endif
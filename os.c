@@ -0,0 +1,409 @@
+#define _GNU_SOURCE /* MAP_ANONYMOUS, madvise, mremap */
+
+#include <fcntl.h> /* open */
+#include <pthread.h> /* pthread_atfork */
+#include <sys/mman.h> /* mmap, munmap, mprotect, madvise, mremap */
+#include <sys/sysinfo.h> /* sysinfo */
+#include <string.h> /* memmove */
+#include <unistd.h> /* close, ftruncate, getpid, read, unlink, write */
+
+#include "internal.h"
+
+/* Linux 5.4, in case the headers are older. */
+#ifndef MADV_COLD
+#define MADV_COLD 20
+#endif
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+/* Linux 4.17. Older kernels take it as a hint, which is checked for. */
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+/* Every page the allocator uses is obtained from and returned to the OS
+ * through these functions, so there is one place to change how that happens.
+ */
+
+/* In deterministic mode, every mapping is carved out of a single region
+ * reserved at a fixed address, instead of wherever mmap(2) and ASLR would put
+ * it. Ranges given back are purged and kept in a list sorted by address, and
+ * requests take the lowest range that fits before extending the used part of
+ * the region. The same sequence of calls then gets the same addresses on every
+ * run. Once the region is used up, or if it could not be reserved, memory
+ * comes from mmap(2) as usual.
+ */
+enum {
+    DET_NRANGES = 1024,
+};
+
+static struct range {
+    byte *p;
+    usz size;
+} detfree[DET_NRANGES];
+
+static usz detnfree = 0;
+
+/* The region is [detbase, detend), of which [detbase, dettop) has been used. */
+static byte *detbase = 0;
+static byte *dettop = 0;
+static byte *detend = 0;
+
+static inline b32 detowns(void *p) {
+    return detbase <= (byte *)p && (byte *)p < detend;
+}
+
+/* Add [p, p + size) to the free ranges, merging it with its neighbors. Ranges
+ * that end at the top of the used part lower the top instead. When the list is
+ * full the range is dropped, which is wasteful but just as deterministic.
+ */
+static void detinsert(byte *p, usz size) {
+    if (!size)
+        return;
+
+    usz i = 0;
+    while (i < detnfree && detfree[i].p < p)
+        i++;
+
+    if (i > 0 && detfree[i - 1].p + detfree[i - 1].size == p) {
+        i--;
+        p = detfree[i].p;
+        size += detfree[i].size;
+        memmove(&detfree[i], &detfree[i + 1],
+            (detnfree - i - 1) * sizeof(detfree[0]));
+        detnfree--;
+    }
+    if (i < detnfree && p + size == detfree[i].p) {
+        size += detfree[i].size;
+        memmove(&detfree[i], &detfree[i + 1],
+            (detnfree - i - 1) * sizeof(detfree[0]));
+        detnfree--;
+    }
+
+    if (p + size == dettop) {
+        dettop = p;
+        return;
+    }
+    if (detnfree == DET_NRANGES)
+        return;
+    memmove(&detfree[i + 1], &detfree[i], (detnfree - i) * sizeof(detfree[0]));
+    detfree[i].p = p;
+    detfree[i].size = size;
+    detnfree++;
+}
+
+/* Take size bytes aligned to align from the lowest free range that has them,
+ * or from the top of the used part. Return 0 if the region is used up.
+ */
+static void *dettake(usz size, usz align) {
+    for (usz i = 0; i < detnfree; i++) {
+        byte *p = detfree[i].p;
+        byte *end = p + detfree[i].size;
+        byte *q = (byte *)ALIGN_UP((uptr)p, align);
+        if (q > end || (usz)(end - q) < size)
+            continue;
+
+        memmove(&detfree[i], &detfree[i + 1],
+            (detnfree - i - 1) * sizeof(detfree[0]));
+        detnfree--;
+        detinsert(p, q - p);
+        detinsert(q + size, end - q - size);
+        return q;
+    }
+
+    byte *q = (byte *)ALIGN_UP((uptr)dettop, align);
+    if (q > detend || (usz)(detend - q) < size)
+        return 0;
+    byte *top = dettop;
+    dettop = q + size;
+    detinsert(top, q - top);
+    return q;
+}
+
+/* Give [p, p + size) back to the region. It reads back as zeroes when it is
+ * handed out again.
+ */
+static void detrelease(void *p, usz size) {
+    madvise(p, size, MADV_DONTNEED);
+    detinsert(p, size);
+}
+
+/* Reserve size bytes at hint for deterministic mode. Return false if the
+ * range is taken, in which case the allocator carries on without it.
+ */
+b32 osdetinit(uptr hint, usz size) {
+    hint = ALIGN_UP(hint, (uptr)pagesize);
+    size = ALIGN_UP(size, (usz)pagesize);
+    void *p = mmap((void *)hint, size, PROT_READ | PROT_WRITE,
+        MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED_NOREPLACE,
+        -1, 0);
+    if (p == MAP_FAILED)
+        return 0;
+    if ((uptr)p != hint) {
+        munmap(p, size);
+        return 0;
+    }
+    detbase = dettop = p;
+    detend = detbase + size;
+    return 1;
+}
+
+/* Map size bytes of fresh, zeroed memory. Return 0 on failure. size must be a
+ * multiple of the page size.
+ */
+void *osmap(usz size) {
+    void *p = detbase ? dettake(size, pagesize) : 0;
+    if (!p) {
+        stats.nsys++;
+        p = mmap(0, size, PROT_READ | PROT_WRITE,
+            MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (p == MAP_FAILED)
+            return 0;
+    }
+    stats.mapped += size;
+    return p;
+}
+
+/* Map size bytes aligned to align, which must be a power of two multiple of
+ * the page size. mmap(2) can't be asked for an alignment, so map enough to
+ * contain an aligned range and unmap whatever sticks out on either side.
+ */
+void *osmapaligned(usz size, usz align) {
+    assert_aligned(size, pagesize);
+    assert((align & (align - 1)) == 0);
+
+    if (detbase) {
+        void *q = dettake(size, align);
+        if (q) {
+            stats.mapped += size;
+            return q;
+        }
+    }
+
+    usz over = size + align - pagesize;
+    byte *p = osmap(over);
+    if (!p)
+        return 0;
+
+    byte *q = (byte *)ALIGN_UP((uptr)p, align);
+    usz head = q - p;
+    usz tail = over - head - size;
+    if (head)
+        munmap(p, head);
+    if (tail)
+        munmap(q + size, tail);
+    stats.nsys += (head != 0) + (tail != 0);
+    stats.mapped -= head + tail;
+    return q;
+}
+
+/* Give size bytes at p back to the OS.
+ */
+void osunmap(void *p, usz size) {
+    stats.mapped -= size;
+    stats.nsys++;
+    if (detowns(p))
+        detrelease(p, size);
+    else
+        munmap(p, size);
+}
+
+/* Map size bytes like osmap(), followed by room bytes of address space that
+ * are reserved, but take no memory and can't be touched until oscommit().
+ * Return 0 on failure, and in deterministic mode, whose region is carved
+ * without gaps.
+ */
+void *osreserve(usz size, usz room) {
+    if (detbase)
+        return 0;
+    stats.nsys++;
+    byte *p = mmap(0, size + room, PROT_NONE,
+        MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return 0;
+    if (!oscommit(p, size)) {
+        munmap(p, size + room);
+        return 0;
+    }
+    return p;
+}
+
+/* Make size bytes of reserved address space at p usable. They read as zeroes.
+ */
+b32 oscommit(void *p, usz size) {
+    assert_ptr_aligned(p, pagesize);
+    stats.nsys++;
+    if (mprotect(p, size, PROT_READ | PROT_WRITE))
+        return 0;
+    stats.mapped += size;
+    return 1;
+}
+
+/* Give the pages of size committed bytes at p back to the OS, and make them
+ * reserved again, until the next oscommit().
+ */
+b32 osdecommit(void *p, usz size) {
+    assert_ptr_aligned(p, pagesize);
+    stats.nsys++;
+    if (mprotect(p, size, PROT_NONE))
+        return 0;
+    madvise(p, size, MADV_DONTNEED);
+    stats.mapped -= size;
+    return 1;
+}
+
+/* Give back a mapping from osreserve(), size bytes of it committed.
+ */
+void osunreserve(void *p, usz size, usz room) {
+    stats.mapped -= size;
+    stats.nsys++;
+    munmap(p, size + room);
+}
+
+/* osmap() and osunmap() for any thread: no deterministic region, and stats is
+ * left alone. Callers count into their shard, see stats.c.
+ */
+void *osmapmt(usz size) {
+    void *p = mmap(0, size, PROT_READ | PROT_WRITE,
+        MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    return p == MAP_FAILED ? 0 : p;
+}
+
+void osunmapmt(void *p, usz size) {
+    munmap(p, size);
+}
+
+/* Let the OS reclaim the pages in [p, p + size) while keeping them mapped.
+ * They read back as zeroes the next time they are touched.
+ */
+void ospurge(void *p, usz size) {
+    assert_ptr_aligned(p, pagesize);
+    stats.nsys++;
+    madvise(p, size, MADV_DONTNEED);
+}
+
+/* Shrink the mapping at p from size to nsize bytes without moving it. Both
+ * must be multiples of the page size.
+ */
+b32 osshrink(void *p, usz size, usz nsize) {
+    assert(nsize <= size);
+    assert_aligned(nsize, pagesize);
+    stats.nsys++;
+    if (detowns(p))
+        detrelease((byte *)p + nsize, size - nsize);
+    else if (mremap(p, size, nsize, 0) == MAP_FAILED)
+        return 0;
+    stats.mapped -= size - nsize;
+    return 1;
+}
+
+/* Tell the OS that the pages in [p, p + size) are unlikely to be used soon.
+ * MADV_COLD makes them the first to be reclaimed; MADV_PAGEOUT reclaims them
+ * right away. Either way the contents are kept, in swap if need be, and the
+ * pages are active again once touched. Kernels without support ignore it.
+ */
+void oscold(void *p, usz size, b32 pageout) {
+    assert_ptr_aligned(p, pagesize);
+    stats.nsys++;
+    madvise(p, size, pageout ? MADV_PAGEOUT : MADV_COLD);
+}
+
+/* True if less than pct percent of the RAM is free.
+ */
+b32 oslowmem(usz pct) {
+    struct sysinfo si;
+    if (sysinfo(&si))
+        return 0;
+    return (u64)si.freeram * 100 < (u64)si.totalram * pct;
+}
+
+/* Create the file at path with size bytes and map it shared, so that other
+ * processes can map it too. Return 0 on failure.
+ */
+void *osshm(const char *path, usz size) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return 0;
+
+    void *p = MAP_FAILED;
+    if (!ftruncate(fd, size))
+        p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        unlink(path);
+        return 0;
+    }
+    return p;
+}
+
+/* Unmap the shared mapping at p and remove its file, unless path is 0.
+ */
+void osshmfree(const char *path, void *p, usz size) {
+    munmap(p, size);
+    if (path)
+        unlink(path);
+}
+
+/* Write prefix followed by the pid to buf, which must have room for 20 more
+ * characters. Return the pid. This is snprintf(3) without the allocations.
+ */
+u64 ospidpath(char *buf, const char *prefix) {
+    u64 pid = getpid();
+    while (*prefix)
+        *buf++ = *prefix++;
+
+    char digits[20];
+    int n = 0;
+    for (u64 x = pid; x || !n; x /= 10)
+        digits[n++] = '0' + x % 10;
+    while (n)
+        *buf++ = digits[--n];
+    *buf = 0;
+    return pid;
+}
+
+/* Create or truncate the file at path for writing. Return -1 on failure.
+ */
+int oscreate(const char *path) {
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+/* Write len bytes at p to fd, retrying short writes. Errors are dropped.
+ */
+void oswrite(int fd, const void *p, usz len) {
+    const byte *b = p;
+    while (len) {
+        isz n = write(fd, b, len);
+        if (n <= 0)
+            return;
+        b += n;
+        len -= n;
+    }
+}
+
+void osclose(int fd) {
+    close(fd);
+}
+
+/* Read up to cap - 1 bytes of the file at path into buf and terminate them.
+ * Return the number of bytes read, 0 if the file can't be read.
+ */
+usz osreadfile(const char *path, char *buf, usz cap) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    usz len = 0;
+    isz n;
+    while (len < cap - 1 && (n = read(fd, buf + len, cap - 1 - len)) > 0)
+        len += n;
+    close(fd);
+    buf[len] = 0;
+    return len;
+}
+
+/* Have child called in the child process after every fork(2).
+ */
+void osatfork(void (*child)(void)) {
+    pthread_atfork(0, 0, child);
+}
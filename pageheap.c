@@ -0,0 +1,327 @@
+#include <string.h> /* memcpy, memset */
+
+#include "internal.h"
+
+/* The page heap serves medium sized requests (config.ph_minsz through
+ * config.ph_maxsz) in whole pages, without block headers.
+ *
+ * A segment is PH_SEGSZ bytes obtained from the OS aligned to its size, and
+ * registered in the page map. Its first pages hold the segment header and an
+ * array with one descriptor per page of the segment. The remaining pages are
+ * divided into runs of contiguous pages, each either free or in use. The
+ * descriptors of the first and last page of a run carry its length and state;
+ * they are the out-of-band equivalent of block headers and footers.
+ *
+ * ┌────────────────────────┐
+ * │struct segment          │
+ * │desc[0] desc[1] ...     │ ───┐ segdesc(sg)[i] describes page i
+ * ├────────────────────────┤    │
+ * │run (in use, 3 pages)   │ <──┘
+ * │                        │
+ * │                        │
+ * ├────────────────────────┤
+ * │run (free, 2 pages)     │ <── runs[2]
+ * │                        │
+ * └────────────────────────┘
+ *
+ * Free runs of every segment are kept in lists by length: runs[n] holds free
+ * runs of n pages, and the last list holds all runs of PH_NLISTS - 1 pages or
+ * more. Freed runs are coalesced with their free neighbors by looking at the
+ * descriptors on either side, and large free runs are purged.
+ *
+ * There are two sets of lists, for clean runs, which read as zeroes because
+ * they are fresh or were purged, and for dirty runs. malloc() takes dirty runs
+ * first so that the clean ones are left for calloc(), which doesn't need to
+ * clear them.
+ */
+
+/* Keep at most PH_SEGCACHE segments with no pages in use. Free runs of at
+ * least PH_PURGEPAGES pages are returned to the OS while they are free.
+ */
+enum {
+    PH_SEGCACHE = 1,
+    PH_PURGEPAGES = 16,
+};
+
+static inline struct segment *descseg(struct pgdesc *d) {
+    return (struct segment *)((uptr)d & ~((uptr)PH_SEGSZ - 1));
+}
+static inline u32 descidx(struct pgdesc *d) {
+    return d - segdesc(descseg(d));
+}
+static inline void *descpage(struct pgdesc *d) {
+    return (byte *)descseg(d) + (usz)descidx(d) * pagesize;
+}
+static inline struct pgdesc *pagedesc(struct segment *sg, void *p) {
+    return &segdesc(sg)[((uptr)p - (uptr)sg) / pagesize];
+}
+static inline u32 runlist(u32 len) {
+    return len < PH_NLISTS ? len : PH_NLISTS - 1;
+}
+static inline b32 runisfree(struct pgdesc *d) {
+    return (d->state & PG_STATE) == PG_FREE;
+}
+static inline struct pgdesc **runhead(struct pgdesc *d) {
+    return &heap->runs[!!(d->state & PG_DIRTY)][runlist(d->len)];
+}
+
+/* Describe len pages starting at d as a run with the given state. Only the
+ * descriptors at both ends of the run are written.
+ */
+static void runinit(struct pgdesc *d, u32 len, u32 state) {
+    assert(len > 0);
+    d->len = len;
+    d->state = state;
+    d[len - 1].len = len;
+    d[len - 1].state = state;
+}
+
+/* Put free run d at the front of the list for its length and cleanliness.
+ */
+static void runprepend(struct pgdesc *d) {
+    assert(runisfree(d));
+    struct pgdesc **head = runhead(d);
+    d->prev = 0;
+    d->next = *head;
+    if (d->next)
+        d->next->prev = d;
+    *head = d;
+}
+
+/* Take free run d off of its list.
+ */
+static void runsever(struct pgdesc *d) {
+    assert(runisfree(d));
+    if (d->prev)
+        d->prev->next = d->next;
+    else
+        *runhead(d) = d->next;
+    if (d->next)
+        d->next->prev = d->prev;
+    d->prev = d->next = 0;
+}
+
+/* Find a free run of at least len pages in one set of lists. Runs in the
+ * exact lists fit as they are; runs in the last list have to be searched.
+ */
+static struct pgdesc *runfindin(struct pgdesc **lists, u32 len) {
+    for (u32 i = runlist(len); i < PH_NLISTS - 1; i++) {
+        if (lists[i])
+            return lists[i];
+    }
+    for (struct pgdesc *d = lists[PH_NLISTS - 1]; d; d = d->next) {
+        if (d->len >= len)
+            return d;
+    }
+    return 0;
+}
+
+/* Find a free run of at least len pages, clean ones first if clean is set and
+ * dirty ones first otherwise.
+ */
+static struct pgdesc *runfind(u32 len, b32 clean) {
+    struct pgdesc *d = runfindin(heap->runs[!clean], len);
+    return d ? d : runfindin(heap->runs[clean], len);
+}
+
+/* Take the first len pages of free run d, which must be off its list, and
+ * return the rest to the lists.
+ */
+static void runcarve(struct pgdesc *d, u32 len) {
+    assert(d->len >= len);
+    u32 rest = d->len - len;
+    u32 dirty = d->state & PG_DIRTY;
+
+    runinit(d, len, PG_USED);
+    if (rest) {
+        runinit(d + len, rest, PG_FREE | dirty);
+        runprepend(d + len);
+    }
+    descseg(d)->nused += len;
+}
+
+/* Return len in-use pages starting at d to the free lists, coalescing with the
+ * free runs on either side. The descriptor before d is the last page of the
+ * previous run (or a header page), and the one after the run is the first page
+ * of the next run.
+ */
+static struct pgdesc *runrelease(struct pgdesc *d, u32 len) {
+    struct segment *sg = descseg(d);
+    u32 dirty = PG_DIRTY;
+    assert(sg->nused >= len);
+    sg->nused -= len;
+
+    struct pgdesc *dq = d - 1;
+    if (runisfree(dq)) {
+        dq -= dq->len - 1;
+        runsever(dq);
+        dirty |= dq->state & PG_DIRTY;
+        len += dq->len;
+        d = dq;
+    }
+
+    dq = d + len;
+    if (descidx(dq) < sg->npages && runisfree(dq)) {
+        runsever(dq);
+        len += dq->len;
+    }
+
+    runinit(d, len, PG_FREE | dirty);
+    if (len >= PH_PURGEPAGES)
+        runpurge(d);
+    runprepend(d);
+    return d;
+}
+
+/* Return the pages of free run d to the OS. They stay mapped and read back as
+ * zeroes.
+ */
+void runpurge(struct pgdesc *d) {
+    assert(runisfree(d));
+    if (!(d->state & PG_DIRTY))
+        return;
+    ospurge(descpage(d), (usz)d->len * pagesize);
+    runinit(d, d->len, PG_FREE);
+}
+
+/* Map a new segment, register it in the page map and make all of its pages
+ * past the header a single free run.
+ */
+struct segment *segalloc(void) {
+    struct segment *sg = osmapaligned(PH_SEGSZ, PH_SEGSZ);
+    if (!sg)
+        return 0;
+    if (!pmset(sg, PH_SEGSZ, sg)) {
+        osunmap(sg, PH_SEGSZ);
+        return 0;
+    }
+    heap->seg_count++;
+
+    sg->size = PH_SEGSZ;
+    sg->kind = SEG_PAGES;
+    sg->heap = heap;
+    sg->npages = PH_SEGSZ / pagesize;
+    sg->hdrpages = ALIGN_UP(SEG_HDR_PADSZ
+        + sg->npages * sizeof(struct pgdesc), (usz)pagesize) / pagesize;
+    sg->nused = 0;
+
+    sg->next = heap->segbase;
+    if (sg->next)
+        sg->next->prev = sg;
+    heap->segbase = sg;
+
+    /* Fresh pages are zero and not resident, so the run is not dirty. */
+    struct pgdesc *d = segdesc(sg);
+    runinit(d, sg->hdrpages, PG_HDR);
+    runinit(d + sg->hdrpages, sg->npages - sg->hdrpages, PG_FREE);
+    runprepend(d + sg->hdrpages);
+    return sg;
+}
+
+/* Return an entire segment to the OS. It must have no pages in use, which
+ * leaves a single free run after the header.
+ */
+void segfree(struct segment *sg) {
+    assert(sg->nused == 0);
+    runsever(segdesc(sg) + sg->hdrpages);
+
+    heap->seg_count--;
+    if (sg->prev)
+        sg->prev->next = sg->next;
+    else
+        heap->segbase = sg->next;
+    if (sg->next)
+        sg->next->prev = sg->prev;
+
+    pmset(sg, sg->size, 0);
+    osunmap(sg, sg->size);
+}
+
+/* Serve a request of size bytes with a run of whole pages, zeroed if zero is
+ * set.
+ */
+void *phalloc(usz size, b32 zero) {
+    u32 len = ALIGN_UP(usz_max(size, 1), (usz)pagesize) / pagesize;
+    assert(len <= (u32)(PH_SEGSZ / pagesize));
+
+    struct pgdesc *d = runfind(len, zero);
+    if (!d) {
+        struct segment *sg = segalloc();
+        if (!sg)
+            return 0;
+        d = segdesc(sg) + sg->hdrpages;
+    }
+
+    b32 dirty = d->state & PG_DIRTY;
+    runsever(d);
+    runcarve(d, len);
+    if (zero && dirty)
+        memset(descpage(d), 0, (usz)len * pagesize);
+    return descpage(d);
+}
+
+/* Give back the run that starts at p. When that leaves its segment empty, the
+ * segment is unmapped unless it is within the cache.
+ */
+void phfree(struct segment *sg, void *p) {
+    assert_ptr_aligned(p, pagesize);
+    struct pgdesc *d = pagedesc(sg, p);
+    assert((d->state & PG_STATE) == PG_USED);
+
+    runrelease(d, d->len);
+    if (sg->nused == 0 && heap->seg_count > PH_SEGCACHE)
+        segfree(sg);
+}
+
+/* The number of usable bytes in the run that starts at p.
+ */
+usz phsize(struct segment *sg, void *p) {
+    struct pgdesc *d = pagedesc(sg, p);
+    assert((d->state & PG_STATE) == PG_USED);
+    return (usz)d->len * pagesize;
+}
+
+/* Resize the run at p in place to fit size bytes. Shrinking releases the tail
+ * pages, and growing takes pages from a free run right after p if it is big
+ * enough. Return false if p can't grow.
+ */
+b32 phresize(struct segment *sg, void *p, usz size) {
+    struct pgdesc *d = pagedesc(sg, p);
+    u32 len = ALIGN_UP(usz_max(size, 1), (usz)pagesize) / pagesize;
+    u32 cur = d->len;
+
+    if (len == cur)
+        return 1;
+
+    if (len < cur) {
+        runinit(d, len, PG_USED);
+        runinit(d + len, cur - len, PG_USED);
+        runrelease(d + len, cur - len);
+        return 1;
+    }
+
+    struct pgdesc *dq = d + cur;
+    if (descidx(dq) < sg->npages && runisfree(dq) && cur + dq->len >= len) {
+        runsever(dq);
+        sg->nused -= cur;
+        runinit(d, cur + dq->len, PG_FREE | (dq->state & PG_DIRTY));
+        runcarve(d, len);
+        return 1;
+    }
+    return 0;
+}
+
+/* Resize the run at p to fit size bytes, moving the contents to a new
+ * allocation if it can't be done in place.
+ */
+void *phrealloc(struct segment *sg, void *p, usz size) {
+    if (phresize(sg, p, size))
+        return p;
+
+    void *q = alloc(size, 0);
+    if (!q)
+        return 0;
+    memcpy(q, p, phsize(sg, p));
+    phfree(sg, p);
+    return q;
+}
@@ -0,0 +1,57 @@
+#include "internal.h"
+
+/* The page map answers which segment, if any, an address belongs to. Segments
+ * are aligned to PM_GRAIN, so the address bits above PM_SHIFT name the grain a
+ * pointer falls in. The map is a two level radix tree over those bits; the
+ * root is static and leaves are mapped when first needed. A pointer into a
+ * span has no entry and maps to 0.
+ *
+ * ┌────────────────────────┐
+ * │ root   13 bits         │ ──> leaf
+ * ├────────────────────────┤
+ * │ leaf   13 bits         │ ──> struct segment *
+ * ├────────────────────────┤
+ * │ offset 22 bits         │
+ * └────────────────────────┘
+ */
+enum {
+    PM_ADDRBITS = 48,
+    PM_BITS = PM_ADDRBITS - PM_SHIFT,
+    PM_LEAFBITS = PM_BITS / 2,
+    PM_ROOTBITS = PM_BITS - PM_LEAFBITS,
+    PM_LEAFSZ = (1 << PM_LEAFBITS) * sizeof(struct segment *),
+};
+
+static struct segment **pmroot[1 << PM_ROOTBITS];
+
+/* Point every grain in [p, p + len) to sg, or clear them if sg is 0. Return
+ * false if a leaf could not be mapped.
+ */
+b32 pmset(void *p, usz len, struct segment *sg) {
+    assert_ptr_aligned(p, PM_GRAIN);
+    assert_aligned(len, PM_GRAIN);
+
+    for (uptr key = (uptr)p >> PM_SHIFT; len; key++, len -= PM_GRAIN) {
+        assert(key >> PM_BITS == 0);
+        struct segment ***leaf = &pmroot[key >> PM_LEAFBITS];
+        if (!*leaf) {
+            if (!sg)
+                continue;
+            if (!(*leaf = osmap(ALIGN_UP(PM_LEAFSZ, pagesize))))
+                return 0;
+        }
+        (*leaf)[key & ((1 << PM_LEAFBITS) - 1)] = sg;
+    }
+    return 1;
+}
+
+/* Find the segment that contains p, or 0 if p is not in one.
+ */
+struct segment *pmget(void *p) {
+    uptr key = (uptr)p >> PM_SHIFT;
+    if (key >> PM_BITS)
+        return 0;
+
+    struct segment **leaf = pmroot[key >> PM_LEAFBITS];
+    return leaf ? leaf[key & ((1 << PM_LEAFBITS) - 1)] : 0;
+}
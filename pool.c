@@ -0,0 +1,278 @@
+#include <pthread.h> /* pthread_key_create, pthread_once, pthread_setspecific */
+
+#include "internal.h"
+
+/* Pools of fixed size objects that any number of threads may allocate from
+ * and free to at once, without locks. The rest of the allocator is single
+ * threaded; pools share nothing with it but the OS layer, and count into the
+ * shard of their thread, see stats.c.
+ *
+ * Each thread keeps a magazine per pool: a chain of up to POOL_MAGSZ free
+ * objects that it takes from and frees to without synchronization. A thread
+ * whose magazine runs empty pops a full one from the pool's depot, and one
+ * whose magazine is full pushes it there, so there is one compare and swap
+ * for every POOL_MAGSZ objects. The depot is a Treiber stack of magazines,
+ * linked through their first objects:
+ *
+ *    depot ──> obj ──next──> obj ──next──> ... 0
+ *               │
+ *             batch
+ *               v
+ *              obj ──next──> ...
+ *
+ * A pop reads the batch link of the top magazine before swapping it in, and
+ * by then another thread may have popped that magazine, used it up and
+ * pushed a different one at the same address (ABA). The depot head carries a
+ * count in its top POOL_TAGBITS bits that every swap bumps, so such a swap
+ * fails. Reading a link of an object that is in use is harmless, since chunks
+ * are only unmapped when the pool is destroyed.
+ *
+ * When the depot is empty, the thread maps a new chunk of objects, keeps one
+ * magazine of it and pushes the others. A thread that exits hands its
+ * magazines back to the depot.
+ */
+
+enum {
+    POOL_MAGSZ = 32,            /* objects in a full magazine */
+    POOL_MAXPOOLS = 16,         /* pools ever created in the process */
+    POOL_CHUNKSZ = 256 * 1024,  /* smallest chunk of objects mapped */
+    POOL_PTRBITS = 48,
+    POOL_TAGBITS = 64 - POOL_PTRBITS,
+};
+
+/* A free object. The batch link and count are only set in the first object
+ * of a magazine in the depot.
+ */
+struct poolobj {
+    struct poolobj *next;       /* next object in the magazine */
+    struct poolobj *batch;      /* next magazine in the depot */
+    usz n;                      /* objects in the magazine */
+};
+
+struct poolchunk {
+    struct poolchunk *next;
+    usz size;
+};
+
+struct pool {
+    usz objsz;
+    u32 id;                     /* index of the pool's magazines */
+    u64 depot;                  /* tagged pointer to the top magazine */
+    struct poolchunk *chunks;
+};
+
+struct magazine {
+    struct poolobj *head;
+    usz n;
+};
+
+enum {
+    POOL_CHUNKHDR = ALIGN_UP(sizeof(struct poolchunk), ALIGNMENT),
+    POOL_MINOBJ = ALIGN_UP(sizeof(struct poolobj), ALIGNMENT),
+};
+
+static struct pool *pools[POOL_MAXPOOLS];
+static u32 pool_count = 0;
+static pthread_key_t poolkey;
+static pthread_once_t poolonce = PTHREAD_ONCE_INIT;
+
+static __thread struct magazine mags[POOL_MAXPOOLS];
+static __thread b32 magsregistered;
+
+static inline struct poolobj *tagptr(u64 t) {
+    return (struct poolobj *)(uptr)(t & (((u64)1 << POOL_PTRBITS) - 1));
+}
+
+static inline u64 tagnext(u64 t, struct poolobj *o) {
+    return (uptr)o | ((t >> POOL_PTRBITS) + 1) << POOL_PTRBITS;
+}
+
+/* Push the magazines from first to last, linked through their batch links,
+ * onto the depot.
+ */
+static void poolpush(struct pool *pl, struct poolobj *first,
+    struct poolobj *last) {
+    u64 old = __atomic_load_n(&pl->depot, __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&last->batch, tagptr(old), __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&pl->depot, &old,
+        tagnext(old, first), 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Pop the top magazine off of the depot, or return 0 if it is empty.
+ */
+static struct poolobj *poolpop(struct pool *pl) {
+    u64 old = __atomic_load_n(&pl->depot, __ATOMIC_ACQUIRE);
+    for (;;) {
+        struct poolobj *o = tagptr(old);
+        if (!o)
+            return 0;
+        struct poolobj *next = __atomic_load_n(&o->batch, __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&pl->depot, &old, tagnext(old, next),
+            1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            return o;
+    }
+}
+
+/* Map a chunk, cut it into magazines, keep the first in m and push the rest.
+ */
+static b32 poolrefill(struct pool *pl, struct magazine *m) {
+    usz nmags = (POOL_CHUNKSZ - POOL_CHUNKHDR) / (pl->objsz * POOL_MAGSZ);
+    if (nmags < 2)
+        nmags = 2;
+    usz size = ALIGN_UP(POOL_CHUNKHDR + nmags * POOL_MAGSZ * pl->objsz,
+        (usz)pagesize);
+    struct stats *st = shard();
+    struct poolchunk *c = osmapmt(size);
+    st->nsys++;
+    if (!c)
+        return 0;
+    if ((uptr)c + size > (uptr)1 << POOL_PTRBITS) {
+        osunmapmt(c, size);
+        st->nsys++;
+        return 0;
+    }
+    st->mapped += size;
+    c->size = size;
+
+    byte *p = (byte *)c + POOL_CHUNKHDR;
+    struct poolobj *first = 0, *prev = 0;
+    for (usz i = 0; i < nmags; i++) {
+        struct poolobj *head = (struct poolobj *)p;
+        for (usz j = 0; j < POOL_MAGSZ; j++, p += pl->objsz)
+            ((struct poolobj *)p)->next = j + 1 < POOL_MAGSZ
+                ? (struct poolobj *)(p + pl->objsz) : 0;
+        head->n = POOL_MAGSZ;
+        if (prev)
+            prev->batch = head;
+        else
+            first = head;
+        prev = head;
+    }
+
+    c->next = __atomic_load_n(&pl->chunks, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&pl->chunks, &c->next, c, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    m->head = first;
+    m->n = POOL_MAGSZ;
+    poolpush(pl, first->batch, prev);
+    return 1;
+}
+
+/* Hand the magazines of an exiting thread back to their pools.
+ */
+static void poolthreadexit(void *arg) {
+    (void)arg;
+    for (u32 i = 0; i < POOL_MAXPOOLS; i++) {
+        struct magazine *m = &mags[i];
+        struct pool *pl = __atomic_load_n(&pools[i], __ATOMIC_ACQUIRE);
+        if (pl && m->n) {
+            m->head->n = m->n;
+            poolpush(pl, m->head, m->head);
+        }
+        m->head = 0;
+        m->n = 0;
+    }
+}
+
+static void poolkeyinit(void) {
+    pthread_key_create(&poolkey, poolthreadexit);
+}
+
+/* Make sure the magazines of this thread go back when it exits.
+ */
+static void poolregister(void) {
+    pthread_once(&poolonce, poolkeyinit);
+    pthread_setspecific(poolkey, &magsregistered);
+    magsregistered = 1;
+}
+
+/* Make a pool of objects of size bytes. Return 0 if there are POOL_MAXPOOLS
+ * pools already, or out of memory.
+ */
+struct m_pool *m_pool_create(size_t size) {
+    if (pagesize == 0)
+        minit();
+    u32 id = __atomic_fetch_add(&pool_count, 1, __ATOMIC_RELAXED);
+    if (id >= POOL_MAXPOOLS)
+        return 0;
+
+    struct stats *st = shard();
+    struct pool *pl = osmapmt(ALIGN_UP(sizeof(struct pool), (usz)pagesize));
+    st->nsys++;
+    if (!pl)
+        return 0;
+    st->mapped += ALIGN_UP(sizeof(struct pool), (usz)pagesize);
+    pl->objsz = usz_max(ALIGN_UP(size, ALIGNMENT), POOL_MINOBJ);
+    pl->id = id;
+    __atomic_store_n(&pools[id], pl, __ATOMIC_RELEASE);
+    return (struct m_pool *)pl;
+}
+
+/* Unmap a pool and every object in it. No thread may be using it. Its id is
+ * not reused, so magazines that threads still hold for it are never looked
+ * at again. Objects not given back stay counted as live.
+ */
+void m_pool_destroy(struct m_pool *mp) {
+    struct pool *pl = (struct pool *)mp;
+    struct stats *st = shard();
+    __atomic_store_n(&pools[pl->id], 0, __ATOMIC_RELEASE);
+    for (struct poolchunk *c = pl->chunks, *next; c; c = next) {
+        next = c->next;
+        st->mapped -= c->size;
+        st->nsys++;
+        osunmapmt(c, c->size);
+    }
+    st->mapped -= ALIGN_UP(sizeof(struct pool), (usz)pagesize);
+    st->nsys++;
+    osunmapmt(pl, ALIGN_UP(sizeof(struct pool), (usz)pagesize));
+}
+
+void *m_pool_alloc(struct m_pool *mp) {
+    struct pool *pl = (struct pool *)mp;
+    struct magazine *m = &mags[pl->id];
+    if (!m->n) {
+        if (!magsregistered)
+            poolregister();
+        struct poolobj *o = poolpop(pl);
+        if (o) {
+            m->head = o;
+            m->n = o->n;
+        } else if (!poolrefill(pl, m)) {
+            return 0;
+        }
+    }
+
+    struct poolobj *o = m->head;
+    m->head = o->next;
+    m->n--;
+    struct stats *st = shard();
+    st->nalloc++;
+    st->live += pl->objsz;
+    return o;
+}
+
+void m_pool_free(struct m_pool *mp, void *p) {
+    if (!p)
+        return;
+    struct pool *pl = (struct pool *)mp;
+    struct magazine *m = &mags[pl->id];
+    if (!magsregistered)
+        poolregister();
+    if (m->n == POOL_MAGSZ) {
+        m->head->n = m->n;
+        poolpush(pl, m->head, m->head);
+        m->head = 0;
+        m->n = 0;
+    }
+
+    struct poolobj *o = p;
+    o->next = m->head;
+    m->head = o;
+    m->n++;
+    struct stats *st = shard();
+    st->nfree++;
+    st->live -= pl->objsz;
+}
@@ -0,0 +1,89 @@
+#include "internal.h"
+
+/* Side tables from pointers to a pair of numbers, for bookkeeping on some
+ * allocations that doesn't fit in their headers: tags and leak samples. They
+ * are open addressed with linear probing, in memory mapped on its own, and
+ * take no memory until something is put in them.
+ */
+
+enum {
+    PT_MINSLOTS = 4096,
+};
+
+/* The slot p hashes to. */
+static usz pthome(struct ptab *t, uptr p) {
+    return (usz)(((p >> 4) * 0x9e3779b97f4a7c15ull) >> 32) & (t->cap - 1);
+}
+
+/* The slot holding p, or the empty one where it would go. */
+static usz ptslotof(struct ptab *t, uptr p) {
+    usz i = pthome(t, p);
+    while (t->slots[i].p && t->slots[i].p != p)
+        i = (i + 1) & (t->cap - 1);
+    return i;
+}
+
+/* Double the table, or map the first one. Return false if out of memory.
+ */
+static b32 ptgrow(struct ptab *t) {
+    struct ptslot *old = t->slots;
+    usz ocap = t->cap;
+    usz cap = t->cap ? 2 * t->cap : PT_MINSLOTS;
+    struct ptslot *s = osmap(cap * sizeof(struct ptslot));
+    if (!s)
+        return 0;
+
+    t->slots = s;
+    t->cap = cap;
+    for (usz i = 0; i < ocap; i++) {
+        if (old[i].p)
+            t->slots[ptslotof(t, old[i].p)] = old[i];
+    }
+    if (old)
+        osunmap(old, ocap * sizeof(struct ptslot));
+    return 1;
+}
+
+/* The slot of p, or 0 if p is not in the table.
+ */
+struct ptslot *ptget(struct ptab *t, void *p) {
+    if (!t->count)
+        return 0;
+    struct ptslot *s = &t->slots[ptslotof(t, (uptr)p)];
+    return s->p ? s : 0;
+}
+
+/* Add p to the table and return its slot, or 0 if out of memory. p must not
+ * be in the table already.
+ */
+struct ptslot *ptput(struct ptab *t, void *p) {
+    if (2 * (t->count + 1) > t->cap && !ptgrow(t))
+        return 0;
+    struct ptslot *s = &t->slots[ptslotof(t, (uptr)p)];
+    s->p = (uptr)p;
+    t->count++;
+    return s;
+}
+
+/* Empty slot s, moving later entries of its probe run back so that lookups
+ * need no tombstones.
+ */
+void ptdel(struct ptab *t, struct ptslot *s) {
+    usz i = s - t->slots, j = i;
+    t->count--;
+    for (;;) {
+        t->slots[i].p = 0;
+        for (;;) {
+            j = (j + 1) & (t->cap - 1);
+            if (!t->slots[j].p)
+                return;
+            usz k = pthome(t, t->slots[j].p);
+            /* Move j to i unless its home k lies cyclically in (i, j]. */
+            if (i <= j ? i < k && k <= j : i < k || k <= j)
+                continue;
+            break;
+        }
+        t->slots[i] = t->slots[j];
+        i = j;
+    }
+}
@@ -0,0 +1,108 @@
+#include "internal.h"
+
+/* With site_ticks set, malloc() learns which of its call sites hand out
+ * long-lived blocks, and serves those from spans of their own (SPAN_LONG), so
+ * that they do not pin spans full of short-lived garbage.
+ *
+ * A call site is the return address of malloc(). Sites are kept in a small
+ * direct-mapped table keyed by address; a site that collides with another
+ * takes its slot over and starts from scratch. One in every site_sample
+ * blocks served by spans is sampled: its site and birth tick go in a ring of
+ * samples, and the index of its sample in its header's next link, which is
+ * unused while the block is in use. When a sampled block is freed, it counts
+ * as long-lived for its site if it lived for site_ticks ticks, and as
+ * short-lived otherwise. A sample still alive when the ring comes around to
+ * its slot counts as long-lived if it is old enough, and is dropped if not.
+ *
+ * A site is long-lived once more of its samples were long-lived than not,
+ * out of at least SITE_MINOBS. Counts are halved every SITE_MAXOBS samples,
+ * so a site can change its mind.
+ */
+
+enum {
+    SITE_NSITES = 1024,         /* power of 2 */
+    SITE_NSAMPLES = 4096,
+    SITE_MINOBS = 8,
+    SITE_MAXOBS = 256,
+};
+
+struct site {
+    uptr pc;
+    u32 nshort;
+    u32 nlong;
+};
+
+struct sample {
+    struct block *bp;           /* 0 when the slot is free */
+    u64 born;
+    u32 site;
+};
+
+static struct site sites[SITE_NSITES];
+static struct sample samples[SITE_NSAMPLES];
+static u32 samplehead = 0;
+static usz samplecount = 0;
+
+/* Count an observed lifetime for site s.
+ */
+static void siteobserve(u32 s, b32 lng) {
+    struct site *st = &sites[s];
+    if (lng)
+        st->nlong++;
+    else
+        st->nshort++;
+    if (st->nlong + st->nshort >= SITE_MAXOBS) {
+        st->nlong /= 2;
+        st->nshort /= 2;
+    }
+}
+
+/* The slot in the site table of the call site at pc.
+ */
+u32 siteof(void *pc) {
+    u32 s = (u32)(((uptr)pc * 0x9e3779b97f4a7c15ull) >> 32) & (SITE_NSITES - 1);
+    struct site *st = &sites[s];
+    if (st->pc != (uptr)pc) {
+        st->pc = (uptr)pc;
+        st->nshort = st->nlong = 0;
+    }
+    return s;
+}
+
+/* True if blocks from site s are expected to be long-lived.
+ */
+b32 sitelong(u32 s) {
+    struct site *st = &sites[s];
+    return st->nlong + st->nshort >= SITE_MINOBS && st->nlong > st->nshort;
+}
+
+/* Count a block allocated at site s, and sample it if it is one in
+ * site_sample. Only blocks in spans are sampled.
+ */
+void sitesample(void *p, u32 s) {
+    if (++samplecount < config.site_sample || pmget(p))
+        return;
+    samplecount = 0;
+
+    struct sample *sm = &samples[samplehead];
+    if (sm->bp && tick - sm->born >= config.site_ticks)
+        siteobserve(sm->site, 1);
+
+    struct block *bp = plblk(p);
+    sm->bp = bp;
+    sm->born = tick;
+    sm->site = s;
+    bp->next = samplehead + 1;
+    samplehead = (samplehead + 1) % SITE_NSAMPLES;
+}
+
+/* Count the lifetime of bp, which is being freed, if it is still sampled. Its
+ * slot may have gone to another block since.
+ */
+void sitefree(struct block *bp) {
+    struct sample *sm = &samples[bp->next - 1];
+    if (sm->bp != bp)
+        return;
+    siteobserve(sm->site, tick - sm->born >= config.site_ticks);
+    sm->bp = 0;
+}
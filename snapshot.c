@@ -0,0 +1,134 @@
+#include "internal.h"
+
+/* With snap_every set, every snap_every calls to malloc(), calloc(), realloc()
+ * or free(), the layout of the heap is appended to SNAP_PATH followed by the
+ * pid. heapviz renders a file of those into a heat map over time.
+ *
+ * The file is a sequence of native 64-bit words. Each snapshot is
+ *
+ *    SNAP_MAGIC, calls so far, number of regions
+ *
+ * followed by each region, a span or a page heap segment of any heap, as
+ *
+ *    address, size, SNAP_SPAN or SNAP_PAGES, number of blocks
+ *
+ * followed by one word per block or run of pages in address order: its size,
+ * with SNAP_INUSE set if it is in use. Blocks are contiguous, so their
+ * offsets follow from the sizes; the first one starts after the header. Words
+ * are buffered and written with write(2), since the allocator can't use stdio.
+ */
+
+enum {
+    SNAP_BUFWORDS = 8192,
+};
+
+static u64 snapbuf[SNAP_BUFWORDS];
+static usz snaplen = 0;
+static int snapfd = -1;
+static u64 snapcalls = 0;
+static char snappath[sizeof(SNAP_PATH) + 20];
+
+static void snapflush(void) {
+    if (snapfd >= 0 && snaplen)
+        oswrite(snapfd, snapbuf, snaplen * sizeof(u64));
+    snaplen = 0;
+}
+
+static void snapput(u64 w) {
+    if (snaplen == SNAP_BUFWORDS)
+        snapflush();
+    snapbuf[snaplen++] = w;
+}
+
+static u64 spnblocks(struct span *sp) {
+    u64 n = 0;
+    for (struct block *bp = spfirstblk(sp); bp; bp = blknextadj(bp))
+        n++;
+    return n;
+}
+
+static void snapspan(struct span *sp) {
+    snapput((uptr)sp);
+    snapput(sp->size);
+    snapput(SNAP_SPAN);
+    snapput(spnblocks(sp));
+    for (struct block *bp = spfirstblk(sp); bp; bp = blknextadj(bp))
+        snapput(blksize(bp) | (blkisfree(bp) ? 0 : SNAP_INUSE));
+}
+
+/* The header pages of a segment are not counted as a run. */
+static u64 segnruns(struct segment *sg) {
+    u64 n = 0;
+    for (u32 i = sg->hdrpages; i < sg->npages; i += segdesc(sg)[i].len)
+        n++;
+    return n;
+}
+
+static void snapseg(struct segment *sg) {
+    snapput((uptr)sg);
+    snapput(sg->size);
+    snapput(SNAP_PAGES);
+    snapput(segnruns(sg));
+    for (u32 i = sg->hdrpages; i < sg->npages; i += segdesc(sg)[i].len) {
+        struct pgdesc *d = &segdesc(sg)[i];
+        b32 used = (d->state & PG_STATE) == PG_USED;
+        snapput((u64)d->len * pagesize | (used ? SNAP_INUSE : 0));
+    }
+}
+
+/* Append a snapshot of the heap as it is now.
+ */
+void snapshot(void) {
+    if (snapfd < 0) {
+        ospidpath(snappath, SNAP_PATH);
+        if ((snapfd = oscreate(snappath)) < 0)
+            return;
+    }
+
+    u64 n = 0;
+    for (struct heap *h = &defheap; h; h = h->next) {
+        for (struct span *sp = h->base; sp; sp = sp->next)
+            n++;
+        for (struct segment *sg = h->segbase; sg; sg = sg->next)
+            n++;
+    }
+
+    snapput(SNAP_MAGIC);
+    snapput(snapcalls);
+    snapput(n);
+    for (struct heap *h = &defheap; h; h = h->next) {
+        for (struct span *sp = h->base; sp; sp = sp->next)
+            snapspan(sp);
+        for (struct segment *sg = h->segbase; sg; sg = sg->next)
+            snapseg(sg);
+    }
+    snapflush();
+}
+
+/* Count a call, and take a snapshot if it is one in snap_every.
+ */
+void snaptick(void) {
+    if (++snapcalls % config.snap_every == 0)
+        snapshot();
+}
+
+/* Close the file, at exit or when a test is done with it.
+ */
+__attribute__((destructor))
+void snapfini(void) {
+    if (snapfd < 0)
+        return;
+    snapflush();
+    osclose(snapfd);
+    snapfd = -1;
+}
+
+/* In a child after fork(2), drop what the parent had buffered and leave its
+ * file alone; the child writes snapshots to a file of its own.
+ */
+void snapfork(void) {
+    snaplen = 0;
+    if (snapfd >= 0)
+        osclose(snapfd);
+    snapfd = -1;
+}
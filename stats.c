@@ -0,0 +1,123 @@
+#include <pthread.h> /* pthread_key_create, pthread_once, pthread_setspecific */
+
+#include "internal.h"
+
+/* Counters for work done off the allocator's own thread, i.e. in pools. Each
+ * thread counts into a shard of its own with plain stores, and m_stats()
+ * adds all shards to stats, the counters of the rest of the allocator, when
+ * asked. Readers racing with writers may see a count a little behind.
+ *
+ * Shards are kept in pages mapped for them and never unmapped. A thread
+ * claims a free one the first time it counts something and gives it back
+ * when it exits, counts and all, so the sums stay right and a thread that
+ * comes later takes over from there. There are only ever as many shards as
+ * threads were counting at once.
+ */
+
+struct shard {
+    struct stats s;
+    struct shard *next;         /* next in shardlist */
+    u32 used;                   /* claimed by a live thread */
+};
+
+static struct shard *shardlist = 0;
+static pthread_key_t shardkey;
+static pthread_once_t shardonce = PTHREAD_ONCE_INIT;
+static __thread struct shard *myshard;
+static __thread b32 shardgone;      /* this thread gave its shard back */
+
+/* Counted into when no shard could be mapped, and by threads that count
+ * after giving theirs back on exit; updates may be lost.
+ */
+static struct shard shardlost;
+
+static void shardexit(void *sh) {
+    myshard = 0;
+    shardgone = 1;
+    __atomic_store_n(&((struct shard *)sh)->used, 0, __ATOMIC_RELEASE);
+}
+
+static void shardkeyinit(void) {
+    pthread_key_create(&shardkey, shardexit);
+}
+
+/* Claim a free shard from the list, or return 0 if there is none.
+ */
+static struct shard *shardfind(void) {
+    struct shard *sh = __atomic_load_n(&shardlist, __ATOMIC_ACQUIRE);
+    for (; sh; sh = sh->next) {
+        u32 free = 0;
+        if (!__atomic_load_n(&sh->used, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(&sh->used, &free, 1, 0,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return sh;
+    }
+    return 0;
+}
+
+/* Map a page of shards, claim the first and put the others on the list.
+ */
+static struct shard *shardgrow(void) {
+    struct shard *sh = osmapmt(pagesize);
+    if (!sh)
+        return 0;
+    usz n = pagesize / sizeof(struct shard);
+    for (usz i = 0; i < n; i++)
+        sh[i].next = i + 1 < n ? &sh[i + 1] : 0;
+    sh->used = 1;
+    sh->s.mapped = pagesize;
+    sh->s.nsys = 1;
+
+    struct shard *head = __atomic_load_n(&shardlist, __ATOMIC_RELAXED);
+    do {
+        sh[n - 1].next = head;
+    } while (!__atomic_compare_exchange_n(&shardlist, &head, sh, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return sh;
+}
+
+/* The counters of this thread.
+ */
+struct stats *shard(void) {
+    if (myshard)
+        return &myshard->s;
+    if (shardgone)
+        return &shardlost.s;
+
+    struct shard *sh = shardfind();
+    if (!sh)
+        sh = shardgrow();
+    if (!sh)
+        return &shardlost.s;
+    pthread_once(&shardonce, shardkeyinit);
+    pthread_setspecific(shardkey, sh);
+    myshard = sh;
+    return &sh->s;
+}
+
+static void statsadd(struct stats *s, const struct stats *t) {
+    s->nalloc += __atomic_load_n(&t->nalloc, __ATOMIC_RELAXED);
+    s->nfree += __atomic_load_n(&t->nfree, __ATOMIC_RELAXED);
+    s->nrealloc += __atomic_load_n(&t->nrealloc, __ATOMIC_RELAXED);
+    s->live += __atomic_load_n(&t->live, __ATOMIC_RELAXED);
+    s->mapped += __atomic_load_n(&t->mapped, __ATOMIC_RELAXED);
+    s->nsys += __atomic_load_n(&t->nsys, __ATOMIC_RELAXED);
+}
+
+/* Sum the counters of the allocator and of every shard. A shard that frees
+ * what another allocated counts down past zero; only the sum makes sense.
+ */
+void m_stats(struct m_stats *m) {
+    struct stats s = stats;
+    statsadd(&s, &shardlost.s);
+    struct shard *sh = __atomic_load_n(&shardlist, __ATOMIC_ACQUIRE);
+    for (; sh; sh = sh->next)
+        statsadd(&s, &sh->s);
+
+    m->nalloc = s.nalloc;
+    m->nfree = s.nfree;
+    m->nrealloc = s.nrealloc;
+    m->live = s.live;
+    m->mapped = s.mapped;
+    m->nsys = s.nsys;
+}
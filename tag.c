@@ -0,0 +1,58 @@
+#include "internal.h"
+
+/* Tagged accounting. An allocation made while tg_current is set, or with
+ * m_malloc_tagged(), is counted against its tag, so that the bytes held by a
+ * subsystem can be read at any time with m_tag_stats(). A realloc() keeps the
+ * tag of the allocation it moves.
+ *
+ * Tags live in a side table from pointer to tag, see ptab.c. Untagged
+ * allocations are not in it, and with no tagged allocations live, frees do
+ * not look at it at all.
+ */
+
+/* The tag of allocations made with m_malloc() by this thread, 0 for none. */
+__thread u32 tg_current = 0;
+
+/* Live tagged allocations, each with its tag in a. */
+struct ptab tgtab;
+
+struct m_tag_stats tgstats[M_NTAGS];
+
+/* Count allocation p, with usable bytes, against tag. Tags out of range, and
+ * allocations that don't fit in the table, go uncounted.
+ */
+void tgput(void *p, u32 tag, usz usable) {
+    if (tag >= M_NTAGS)
+        return;
+    struct ptslot *s = ptput(&tgtab, p);
+    if (!s)
+        return;
+
+    s->a = tag;
+    tgstats[tag].bytes += usable;
+    tgstats[tag].count++;
+}
+
+/* Stop counting p, which had usable bytes, if it is tagged. Return its tag,
+ * or 0.
+ */
+u32 tgdrop(void *p, usz usable) {
+    struct ptslot *s = ptget(&tgtab, p);
+    if (!s)
+        return 0;
+
+    u32 tag = s->a;
+    ptdel(&tgtab, s);
+    tgstats[tag].bytes -= usable;
+    tgstats[tag].count--;
+    return tag;
+}
+
+/* Carry the tag of p, which had old usable bytes, over to q, which has
+ * usable bytes, after a realloc() or in place resize. p and q may be equal.
+ */
+void tgmove(void *q, void *p, usz old, usz usable) {
+    u32 tag = tgdrop(p, old);
+    if (tag)
+        tgput(q, tag, usable);
+}
@@ -0,0 +1,112 @@
+#define _GNU_SOURCE /* getpid */
+
+#include <unistd.h> /* getpid */
+
+#include "internal.h"
+
+/* With tm_ring set, the allocator publishes one in every tm_sample events
+ * (allocations, frees and reallocs), along with a snapshot of its stats, to a
+ * ring buffer in a shared memory file. tmread attaches to the file by pid and
+ * streams what is published, without stopping or signaling the process.
+ *
+ * There is one writer, so publishing needs no locks. An event slot has its
+ * seq cleared while it is written and set to the number of the event when it
+ * is done, and the head is bumped after that. A reader copies a slot and
+ * checks that seq was the same number before and after; anything else means
+ * the writer lapped it. The stats snapshot is a sequence lock on statseq.
+ *
+ * ┌────────────────────────┐
+ * │struct tmring           │ head, stats
+ * ├────────────────────────┤
+ * │ring[0]                 │ event head - nslots, ...
+ * │ring[1]                 │
+ * │...                     │
+ * └────────────────────────┘
+ */
+
+struct tmring *tmring = 0;
+
+static usz tmsize = 0;
+static usz tmcount = 0;
+static u64 tmpid = 0;
+static char tmpath[sizeof(TM_PATH) + 20];
+
+/* Create the ring, with as many slots as fit in tm_ring bytes rounded down to
+ * a power of 2. Return false if the file could not be created, in which case
+ * telemetry stays off.
+ */
+b32 tminit(void) {
+    u32 nslots = 1;
+    while ((usz)nslots * 2 * sizeof(struct tmevent) <= config.tm_ring
+        && nslots < (u32)1 << 30)
+        nslots *= 2;
+
+    tmpid = ospidpath(tmpath, TM_PATH);
+    tmsize = ALIGN_UP(sizeof(struct tmring)
+        + nslots * sizeof(struct tmevent), (usz)pagesize);
+    struct tmring *r = osshm(tmpath, tmsize);
+    if (!r)
+        return 0;
+
+    r->nslots = nslots;
+    r->magic = TM_MAGIC;
+    tmring = r;
+    return 1;
+}
+
+/* Stop publishing and remove the ring. This also runs when the process exits,
+ * so that rings do not pile up in /dev/shm; one that was never read is of no
+ * use afterwards. A forked child leaves the ring of its parent alone.
+ */
+__attribute__((destructor))
+void tmfini(void) {
+    if (!tmring || (u64)getpid() != tmpid)
+        return;
+    osshmfree(tmpath, tmring, tmsize);
+    tmring = 0;
+}
+
+/* Publish the stats as they are now.
+ */
+static void tmsnapshot(struct tmring *r) {
+    u64 seq = r->statseq;
+    __atomic_store_n(&r->statseq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    r->stats = stats;
+    __atomic_store_n(&r->statseq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Count an event, and publish it if it is one in tm_sample.
+ */
+void tmrecord(u32 kind, void *p, void *q, usz size) {
+    if (++tmcount < config.tm_sample)
+        return;
+    tmcount = 0;
+
+    struct tmring *r = tmring;
+    u64 seq = r->head;
+    struct tmevent *e = &r->ring[seq & (r->nslots - 1)];
+
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->tick = tick;
+    e->kind = kind;
+    e->p = (uptr)p;
+    e->q = (uptr)q;
+    e->size = size;
+    __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->head, seq + 1, __ATOMIC_RELEASE);
+
+    tmsnapshot(r);
+}
+
+/* In a child after fork(2), stop writing to the ring of the parent. The child
+ * does not get a ring of its own, since most children exec(2) right away and
+ * would leave the file behind.
+ */
+void tmfork(void) {
+    if (!tmring)
+        return;
+    osshmfree(0, tmring, tmsize);
+    tmring = 0;
+}
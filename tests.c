@@ -1,13 +1,18 @@
+#define _POSIX_C_SOURCE 200809L /* fork, pipe */
+
 #include <assert.h>
-#include <unistd.h> /* sysconf */
+#include <unistd.h> /* sysconf, fork, pipe */
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h> /* setenv, unsetenv */
+#include <sys/wait.h> /* waitpid */
+#include <pthread.h>
+#include <dlfcn.h> /* dlopen, dlsym */
 
 #include "malloc.h"
 #include "internal.h"
 
 extern int pagesize; /* defined in malloc.c */
-extern int span_count; /* defined in malloc.c */
-extern struct span *base; /* defined in malloc.c */
 
 void test_minimum_span_allocation(void);
 void test_large_span_allocation(void);
@@ -31,6 +36,34 @@ void test_realloc_truncate(void);
 void test_realloc_extend_with_space(void);
 void test_realloc_extend_move(void);
 void test_free_unmaps_span(void);
+void test_free_list_links(void);
+void test_pageheap_alloc_free(void);
+void test_pageheap_realloc(void);
+void test_config_parse(void);
+void test_buddy_alloc_free(void);
+void test_buddy_realloc(void);
+void test_realloc_trim_span(void);
+void test_realloc_purge_middle(void);
+void test_cold_spans(void);
+void test_expand(void);
+void test_good_size(void);
+void test_calloc_zeroed(void);
+void test_large_cache(void);
+void test_deterministic(void);
+void test_telemetry(void);
+void test_snapshot(void);
+void test_config_file(void);
+void test_utilization(void);
+void test_fork_cow(void);
+void test_call_sites(void);
+void test_tags(void);
+void test_malloc_near(void);
+void test_heaps(void);
+void test_pool(void);
+void test_leaks(void);
+void test_calloc_leaks(void);
+void test_va_headroom(void);
+void test_hooks(void);
 
 int main(void) {
     /* malloc() calls this, so when testing helper functions it needs to be set
@@ -38,6 +71,11 @@ int main(void) {
      */
     pagesize = sysconf(_SC_PAGESIZE);
 
+    /* The span and block tests assume every request is served by a block.
+     * The page heap tests turn it back on.
+     */
+    config.backend = BACKEND_BLOCKS;
+
     printf("pagesize = %d\n", pagesize);
     printf("span_hdr_padsz = %d\n", SPAN_HDR_PADSZ);
     printf("block_hdr_padsz = %d\n", BLOCK_HDR_PADSZ);
@@ -67,6 +105,34 @@ int main(void) {
     test_realloc_extend_with_space();
     test_realloc_extend_move();
     test_free_unmaps_span();
+    test_free_list_links();
+    test_pageheap_alloc_free();
+    test_pageheap_realloc();
+    test_config_parse();
+    test_buddy_alloc_free();
+    test_buddy_realloc();
+    test_realloc_trim_span();
+    test_realloc_purge_middle();
+    test_cold_spans();
+    test_expand();
+    test_good_size();
+    test_calloc_zeroed();
+    test_large_cache();
+    test_deterministic();
+    test_telemetry();
+    test_snapshot();
+    test_config_file();
+    test_utilization();
+    test_fork_cow();
+    test_call_sites();
+    test_tags();
+    test_malloc_near();
+    test_heaps();
+    test_pool();
+    test_leaks();
+    test_calloc_leaks();
+    test_va_headroom();
+    test_hooks();
 
     return 0;
 }
@@ -104,14 +170,14 @@ void test_minimum_span_allocation(void) {
 
     usz used = blksize(b1) + blksize(b2);
     usz rest = sp->size - SPAN_HDR_PADSZ - used;
-    /* Request using up almost all free space. MIN_BLKSZ is 64, so leaving
+    /* Request using up almost all free space. MIN_BLKSZ is 48, so leaving
      * 24 bytes should cause the allocator to give out the entire piece. Take
      * BLOCK_HDR_PADSZ to account for gross_size() adding that to its result.
      */
-    want = rest - 48 - 24;
+    want = rest - BLOCK_HDR_PADSZ - 24;
     gross = gross_size(want);
 
-    /* Here rest = 65152, want = 65080 and gross = 65136. gross leaves 16 bytes
+    /* Here rest = 65168, want = 65112 and gross = 65152. gross leaves 16 bytes
      * at the end of sp, so we should get it all.
      */
     struct block *b3 = blkalloc(gross, bp);
@@ -150,11 +216,11 @@ void test_free_only_span(void) {
     /* sp is the only span on the global list. This actually depends on the
      * other tests cleaning up after themselves.
      */
-    assert(base == sp);
+    assert(heap->base == sp);
 
     spfree(sp);
 
-    assert(!base);
+    assert(!heap->base);
     /* sp has been munmapped--reading through it will segfault. This is an
      * artificial test because cache of SPAN_CACHE spans is kept once
      * allocated. */
@@ -167,7 +233,7 @@ void test_alloc_multiple_spans(void) {
     struct span *s2 = spalloc(gross);
     struct span *s3 = spalloc(gross);
 
-    assert(s3 && base == s3); /* spalloc prepends */
+    assert(s3 && heap->base == s3); /* spalloc prepends */
     assert(s2 && s3->next == s2 && s2->prev == s3);
     assert(s1 && s2->next == s1 && s1->prev == s2);
     assert(!s3->prev && !s1->next);
@@ -202,17 +268,17 @@ void test_free_multiple_spans(void) {
     /* free first span on the list */
     spfree(s3);
 
-    assert(base == s2);
+    assert(heap->base == s2);
     assert(!s2->prev);
 
     /* free last span on the list */
     spfree(s1);
-    assert(base == s2);
+    assert(heap->base == s2);
     assert(!s2->next);
 
     /* free last remaining span */
     spfree(s2);
-    assert(!base);
+    assert(!heap->base);
 
     /* Reallocate to test removing the middle span */
     s1 = spalloc(gross);
@@ -220,7 +286,7 @@ void test_free_multiple_spans(void) {
     s3 = spalloc(gross);
 
     spfree(s2);
-    assert(base == s3);
+    assert(heap->base == s3);
     assert(s3->next == s1 && s1->prev == s3);
     assert(!s3->prev && !s1->next);
 }
@@ -259,7 +325,7 @@ void test_free_single_block(void) {
     struct span *sp = spalloc(gross);
 
     assert(sp && sp->size == MIN_MMAPSZ);
-    assert(base == sp);
+    assert(heap->base == sp);
 
     struct block *bp = blkfind(gross);
     assert(bp && bp->owner == sp);
@@ -286,7 +352,7 @@ void test_free_single_block(void) {
 
     /* SPAN_CACHE == 1, so this span stays even though it's unused. */
     assert(sp->free_list == bp);
-    assert(!bp->next);
+    assert(!blknext(bp));
     assert(*blkfoot(bp) == bp->owner->size - SPAN_HDR_PADSZ);
 
     spfree(sp);
@@ -319,8 +385,8 @@ void test_blknextadj(void) {
     blkfree(b2);
 
     assert(sp->free_list == b2);
-    assert(b2->next == bp);
-    assert(bp->prev == b2);
+    assert(blknext(b2) == bp);
+    assert(blkprev(bp) == b2);
 
     assert(blknextadj(bp) == b3);
     assert(blknextadj(b3) == b2);
@@ -473,7 +539,7 @@ void test_coalesce(void) {
     m_free(p3);
     assert(sp->free_list == bp);
     assert(blksize(bp) == bpsz + gross);
-    assert(bp->next == 0);
+    assert(blknext(bp) == 0);
     assert(sp->blkcount == 2);
 
     /* Does not coalesce -- b1 is last and b2 is in use.
@@ -482,13 +548,13 @@ void test_coalesce(void) {
      */
     m_free(p1);
     assert(sp->free_list == b1);
-    assert(b1->next == bp && bp->next == 0);
+    assert(blknext(b1) == bp && blknext(bp) == 0);
     assert(sp->blkcount == 1);
 
     /* Should coalesce everything back into bp.
      */
     m_free(p2);
-    assert(sp->free_list == bp && !bp->next);
+    assert(sp->free_list == bp && !blknext(bp));
     assert(blksize(bp) == sp->size - SPAN_HDR_PADSZ);
     assert(sp->blkcount == 0);
 
@@ -508,19 +574,19 @@ void test_coalesce(void) {
 
     m_free(blkpayload(b2));
     assert(blkisfree(b2) && blksize(b2) == *blkfoot(b2));
-    assert(sp->free_list == b2 && b2->next == bp && !bp->next);
+    assert(sp->free_list == b2 && blknext(b2) == bp && !blknext(bp));
     assert(sp->blkcount == 3);
 
     m_free(blkpayload(b4));
     /* No change to the free list */
-    assert(sp->free_list == b2 && b2->next == bp && !bp->next);
+    assert(sp->free_list == b2 && blknext(b2) == bp && !blknext(bp));
     assert(blksize(bp) == bpsz + gross);
     assert(blksize(bp) == *blkfoot(bp));
     assert(sp->blkcount == 2);
 
     m_free(blkpayload(b1));
     /* No change to the free list, but b2 changed */
-    assert(sp->free_list == b2 && b2->next == bp && !bp->next);
+    assert(sp->free_list == b2 && blknext(b2) == bp && !blknext(bp));
     assert(blksize(b2) == 2 * gross);
     assert(blksize(b2) == *blkfoot(b2));
     assert(sp->blkcount == 1);
@@ -530,7 +596,7 @@ void test_coalesce(void) {
      */
 
     m_free(blkpayload(b3));
-    assert(sp->free_list == bp && !bp->next);
+    assert(sp->free_list == bp && !blknext(bp));
     assert(blksize(bp) == bpsz + 4 * gross);
     assert(blksize(bp) == *blkfoot(bp));
     assert(blksize(bp) == sp->size - SPAN_HDR_PADSZ);
@@ -754,7 +820,7 @@ void test_free_unmaps_span(void) {
      * SPAN_CACHE == 1.
      */
     m_free(p);
-    assert(base == sp);
+    assert(heap->base == sp);
     assert(sp->blkcount == 0);
 
     /* Request big sizes to fill them up with a single allocation. */
@@ -771,7 +837,7 @@ void test_free_unmaps_span(void) {
     struct span *sr = br->owner;
 
     /* Three different spans, sp reused. */
-    assert(span_count == 3);
+    assert(heap->span_count == 3);
     assert(bp->owner == sp);
     assert(sq != sp && sr != sp && sq != sr);
 
@@ -781,14 +847,1275 @@ void test_free_unmaps_span(void) {
     assert(!sr->free_list);
 
     m_free(r);
-    assert(span_count == 2);
+    assert(heap->span_count == 2);
     m_free(q);
-    assert(span_count == 1);
+    assert(heap->span_count == 1);
     m_free(p);
-    assert(span_count == 1); /* kept */
-    assert(base == sp);
+    assert(heap->span_count == 1); /* kept */
+    assert(heap->base == sp);
     assert(sp->free_list);
 
     spfree(sp); /* manual cleanup for tests */
-    assert(span_count == 0);
+    assert(heap->span_count == 0);
+}
+
+void test_free_list_links(void) {
+    printf("==== test_free_list_links ====\n");
+    usz gross = gross_size(64);
+    struct span *sp = spalloc(gross);
+
+    /* bp -> b2 -> b1 */
+    struct block *bp = blkfind(gross);
+    struct block *b1 = blkalloc(gross, bp);
+    struct block *b2 = blkalloc(gross, bp);
+
+    /* Links are offsets from the span, in units of ALIGNMENT. */
+    assert(blklink(sp, 0) == 0 && blkunlink(sp, 0) == 0);
+    assert(blklink(sp, bp) == SPAN_HDR_PADSZ / ALIGNMENT);
+    assert(blkunlink(sp, blklink(sp, b1)) == b1);
+
+    /* Free list: sp -> b1 -> b2 -> bp */
+    blkfree(b2);
+    blkfree(b1);
+    assert(sp->free_list == b1);
+    assert(blknext(b1) == b2 && blknext(b2) == bp && !blknext(bp));
+    assert(!blkprev(b1) && blkprev(b2) == b1 && blkprev(bp) == b2);
+
+    /* Sever from the middle. */
+    blksever(b2);
+    assert(blknext(b1) == bp && blkprev(bp) == b1);
+
+    spfree(sp);
+}
+
+void test_pageheap_alloc_free(void) {
+    printf("==== test_pageheap_alloc_free ====\n");
+    config.backend = BACKEND_PAGES;
+    usz size = config.ph_minsz;
+    u32 len = size / pagesize;
+
+    char *p = m_malloc(size);
+    char *q = m_malloc(size + 1);
+    assert(p && q);
+    assert_ptr_aligned(p, pagesize);
+    assert(!heap->base); /* no spans involved */
+
+    struct segment *sg = pmget(p);
+    assert(sg && sg == heap->segbase && heap->seg_count == 1);
+    assert(pmget(q) == sg && pmget(p + size - 1) == sg);
+    assert(!plforeign(p) && !plforeign(q));
+    assert(sg->nused == 2 * len + 1);
+
+    /* Runs are carved from the front of the free run, one after the other.
+     * Their descriptors hold the length at both ends.
+     */
+    struct pgdesc *d = segdesc(sg) + sg->hdrpages;
+    assert((char *)sg + (usz)sg->hdrpages * pagesize == p);
+    assert(q == p + size);
+    assert(d->len == len && d[len - 1].len == len);
+    assert(d->state == PG_USED && d[len].len == len + 1);
+    assert(phsize(sg, p) == size && plusable(q) == size + pagesize);
+
+    /* Freeing p leaves a free run in front of q; freeing q coalesces both
+     * into the rest of the segment.
+     */
+    m_free(p);
+    assert((d->state & PG_STATE) == PG_FREE && d->len == len);
+    assert(sg->nused == len + 1);
+    m_free(q);
+    assert(sg->nused == 0);
+    assert((d->state & PG_STATE) == PG_FREE);
+    assert(d->len == sg->npages - sg->hdrpages);
+    assert(!(d->state & PG_DIRTY)); /* large enough to be purged */
+
+    /* The last segment is kept around. */
+    assert(heap->seg_count == 1);
+    segfree(sg);
+    assert(heap->seg_count == 0 && !heap->segbase && !pmget(p));
+    config.backend = BACKEND_BLOCKS;
+}
+
+void test_pageheap_realloc(void) {
+    printf("==== test_pageheap_realloc ====\n");
+    config.backend = BACKEND_PAGES;
+    usz size = 8 * pagesize;
+    if (size < config.ph_minsz)
+        size = config.ph_minsz;
+
+    char *p = m_malloc(size);
+    assert(p);
+    p[0] = 'a';
+    p[size - 1] = 'z';
+    struct segment *sg = pmget(p);
+
+    /* Grow in place into the free run after p. */
+    char *q = m_realloc(p, 2 * size);
+    assert(q == p && plusable(q) == 2 * size);
+    assert(q[0] == 'a' && q[size - 1] == 'z');
+
+    /* Shrink in place, giving the tail pages back. */
+    q = m_realloc(q, size);
+    assert(q == p && plusable(q) == size);
+    assert(sg->nused == size / pagesize);
+
+    /* Block the way with another run and grow again: p has to move. */
+    char *r = m_malloc(size);
+    assert(r == p + size);
+    q = m_realloc(p, 2 * size);
+    assert(q && q != p && pmget(q) == sg);
+    assert(q[0] == 'a' && q[size - 1] == 'z');
+
+    m_free(q);
+    m_free(r);
+    assert(sg->nused == 0);
+    segfree(sg);
+    config.backend = BACKEND_BLOCKS;
+}
+
+void test_config_parse(void) {
+    printf("==== test_config_parse ====\n");
+    struct config saved = config;
+
+    assert(configparse("backend=pages,ph_minsz=32k,ph_maxsz=2M"));
+    assert(config.backend == BACKEND_PAGES);
+    assert(config.ph_minsz == 32 * 1024 && config.ph_maxsz == 2 * 1024 * 1024);
+
+    /* Bad pairs are skipped, good ones still apply. */
+    assert(!configparse("nope=1,backend=blocks,ph_minsz=12q"));
+    assert(config.backend == BACKEND_BLOCKS);
+    assert(config.ph_minsz == 32 * 1024);
+    assert(configparse(""));
+
+    config = saved;
+}
+
+void test_buddy_alloc_free(void) {
+    printf("==== test_buddy_alloc_free ====\n");
+    config.backend = BACKEND_BUDDY;
+    usz mb2 = 2 * 1024 * 1024;
+
+    /* Every block is aligned to its size, rounded up to a power of two. */
+    char *p = m_malloc(pagesize);
+    char *q = m_malloc(3 * pagesize);
+    char *r = m_malloc(mb2);
+    assert(p && q && r);
+    assert_ptr_aligned(p, pagesize);
+    assert_ptr_aligned(q, 4 * pagesize);
+    assert_ptr_aligned(r, mb2);
+    assert(plusable(p) == (usz)pagesize && plusable(q) == 4 * (usz)pagesize);
+    assert(plusable(r) == mb2);
+
+    struct segment *sg = pmget(p);
+    assert(sg && sg->kind == SEG_BUDDY && sg == heap->arenabase);
+    assert(pmget(q) == sg && pmget(r) == sg && heap->arena_count == 1);
+    assert(!heap->base && !heap->segbase);
+    assert(sg->nused == 1 + 4 + mb2 / pagesize);
+
+    /* Freeing merges buddies back up; with everything freed the free lists
+     * hold exactly the buddies of the header again.
+     */
+    m_free(q);
+    m_free(p);
+    m_free(r);
+    assert(sg->nused == 0);
+    struct buddy *bd = segbuddy(sg);
+    for (u32 k = 0; k < bd->top; k++) {
+        if (k < bd->order[0])
+            assert(!bd->heads[k]);
+        else
+            assert(bd->heads[k] == 1u << k);
+    }
+
+    bdarenafree(sg);
+    assert(!heap->arenabase && heap->arena_count == 0 && !pmget(p));
+    config.backend = BACKEND_BLOCKS;
+}
+
+void test_buddy_realloc(void) {
+    printf("==== test_buddy_realloc ====\n");
+    config.backend = BACKEND_BUDDY;
+    usz size = 4 * pagesize;
+
+    char *p = m_malloc(size);
+    p[0] = 'a';
+    p[size - 1] = 'z';
+    struct segment *sg = pmget(p);
+
+    /* The buddy of p is free, so p grows in place and back. */
+    char *q = m_realloc(p, 2 * size);
+    assert(q == p && plusable(q) == 2 * size);
+    q = m_realloc(q, size);
+    assert(q == p && plusable(q) == size);
+    assert(sg->nused == size / pagesize);
+
+    /* Take the buddy: now p has to move. */
+    char *r = m_malloc(size);
+    assert(r == p + size);
+    q = m_realloc(p, 2 * size);
+    assert(q != p && pmget(q) == sg);
+    assert_ptr_aligned(q, 2 * size);
+    assert(q[0] == 'a' && q[size - 1] == 'z');
+
+    m_free(q);
+    m_free(r);
+    assert(sg->nused == 0);
+    bdarenafree(sg);
+    config.backend = BACKEND_BLOCKS;
+}
+
+void test_realloc_trim_span(void) {
+    printf("==== test_realloc_trim_span ====\n");
+    usz size = 1024 * 1024;
+
+    /* A large request gets a span of its own, at the end of it. */
+    char *p = m_malloc(size);
+    struct block *bp = plblk(p);
+    struct span *sp = bp->owner;
+    assert(sp->size >= size && !blknextadj(bp));
+    usz off = (uptr)bp - (uptr)sp;
+
+    /* Shrinking it unmaps the tail of the span. What is left of the free
+     * space after bp ends at the new end of the span.
+     */
+    char *q = m_realloc(p, 1024);
+    assert(q == p);
+    assert(sp->size == ALIGN_UP(off + gross_size(1024), (usz)pagesize));
+    struct block *bq = blknextadj(bp);
+    assert(bq && blkisfree(bq) && sp->free_list == bq);
+    assert(!blknextadj(bq));
+    assert((uptr)bq + blksize(bq) == (uptr)sp + sp->size);
+
+    spfree(sp);
+}
+
+void test_realloc_purge_middle(void) {
+    printf("==== test_realloc_purge_middle ====\n");
+    usz big = gross_size(512 * 1024);
+    usz small = gross_size(64);
+    struct span *sp = spalloc(big + small);
+
+    /* Physical layout: bp (free) -> b2 -> b1 */
+    struct block *bp = blkfind(small);
+    struct block *b1 = blkalloc(small, bp);
+    struct block *b2 = blkalloc(big, bp);
+    char *p = blkpayload(b2);
+    memset(p, 0x5a, plsize(b2));
+
+    /* The free block between b2 and b1 is purged, save for the pages with
+     * its header and footer.
+     */
+    char *q = realloc_truncate(b2, 64);
+    assert(q == p);
+    struct block *bq = blknextadj(b2);
+    assert(bq && blkisfree(bq) && blknextadj(bq) == b1);
+    char *mid = (char *)bq + blksize(bq) / 2;
+    assert(*mid == 0);
+    assert(*(p + 63) == 0x5a);
+
+    spfree(sp);
+}
+
+void test_cold_spans(void) {
+    printf("==== test_cold_spans ====\n");
+    config.cold_ticks = 100;
+
+    /* p sits in one span, q fills another one that is first on the list and
+     * keeps serving small requests.
+     */
+    char *p = m_malloc(64);
+    char *p2 = m_malloc(64);
+    char *q = m_malloc(100 * 1024);
+    struct span *sp = plblk(p)->owner;
+    struct span *sq = plblk(q)->owner;
+    assert(sp != sq && heap->base == sq);
+    p[0] = 'p';
+
+    for (int i = 0; i < 200; i++)
+        m_free(m_malloc(64));
+    assert(sp->flags & SPAN_COLD);
+    assert(!(sq->flags & SPAN_COLD));
+    assert(p[0] == 'p'); /* nothing was lost */
+
+    /* Using the span again makes it warm. */
+    m_free(p2);
+    assert(!(sp->flags & SPAN_COLD));
+
+    m_free(p);
+    m_free(q);
+    assert(heap->span_count == 1);
+    spfree(heap->base);
+    config.cold_ticks = 0;
+}
+
+void test_expand(void) {
+    printf("==== test_expand ====\n");
+    usz size = 1024;
+
+    /* sp -> [free] -> p2 -> p1 */
+    char *p1 = m_malloc(size);
+    char *p2 = m_malloc(size);
+    struct span *sp = plblk(p1)->owner;
+
+    /* p2 can't grow while p1 is in use, and stays where it is. */
+    assert(m_expand(p2, 2 * size, 3 * size) == size);
+    assert(plblk(p2)->owner == sp && blknextadj(plblk(p2)) == plblk(p1));
+
+    /* With p1 freed, p2 grows to max if it fits, or to min otherwise. */
+    m_free(p1);
+    assert(m_expand(p2, size + 1, 4 * size) == ALIGN_UP(size + 1, ALIGNMENT));
+    assert(m_expand(p2, 0, 0) == MIN_BLKSZ - BLOCK_HDR_PADSZ);
+    assert(m_expand(p2, size, size) == size);
+
+    /* A page heap run grows into the pages after it. */
+    config.backend = BACKEND_PAGES;
+    char *q = m_malloc(config.ph_minsz);
+    usz got = m_expand(q, config.ph_minsz, 2 * config.ph_minsz);
+    assert(got == 2 * config.ph_minsz && plusable(q) == got);
+    m_free(q);
+    segfree(heap->segbase);
+    config.backend = BACKEND_BLOCKS;
+
+    m_free(p2);
+    spfree(sp);
+    assert(m_expand(0, 100, 200) == 0);
+}
+
+void test_good_size(void) {
+    printf("==== test_good_size ====\n");
+    usz sizes[] = { 0, 1, 100, 1000, 5000, 20000, 100000, 3000000 };
+    usz ph_minsz = config.ph_minsz;
+
+    /* Whatever the backend, the good size is what malloc() hands out. */
+    for (usz backend = BACKEND_BLOCKS; backend <= BACKEND_BUDDY; backend++) {
+        config.backend = backend;
+        for (usz i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            usz good = m_good_size(sizes[i], 0);
+            assert(good >= sizes[i]);
+            char *p = m_malloc(sizes[i]);
+            assert(plusable(p) >= good);
+            if (pmget(p))
+                assert(plusable(p) == good);
+            assert(m_good_size(good, 0) == good);
+            m_free(p);
+        }
+    }
+    assert(m_good_size(100, 0) == 112);
+
+    /* Alignment beyond ALIGNMENT only comes with whole pages. */
+    config.backend = BACKEND_BLOCKS;
+    assert(m_good_size(100, M_ALIGN(16)) == 112);
+    assert(m_good_size(100, M_ALIGN(64)) == 0);
+
+    config.backend = BACKEND_PAGES;
+    assert(m_good_size(100, M_ALIGN(64)) == ph_minsz);
+    assert(m_good_size(100, M_ALIGN(2 * pagesize)) == 0);
+
+    config.backend = BACKEND_BUDDY;
+    usz mb2 = 2 * 1024 * 1024;
+    assert(m_good_size(100, M_ALIGN(mb2)) == mb2);
+    char *p = m_malloc(m_good_size(100, M_ALIGN(mb2)));
+    assert_ptr_aligned(p, mb2);
+    m_free(p);
+
+    config.backend = BACKEND_BLOCKS;
+    while (heap->segbase)
+        segfree(heap->segbase);
+    while (heap->arenabase)
+        bdarenafree(heap->arenabase);
+    while (heap->base)
+        spfree(heap->base);
+    lcflush();
+}
+
+void test_calloc_zeroed(void) {
+    printf("==== test_calloc_zeroed ====\n");
+    usz size = 100;
+
+    /* Memory fresh from the OS is known to be zero, and stays so after a
+     * block is carved out of it.
+     */
+    char *p = m_calloc(1, size);
+    struct span *sp = plblk(p)->owner;
+    assert(blkiszeroed(sp->free_list));
+    for (usz i = 0; i < size; i++)
+        assert(p[i] == 0);
+
+    /* Once a block is freed into it, it has to be cleared. */
+    char *q = m_malloc(size);
+    memset(q, 0xff, size);
+    m_free(q);
+    assert(!blkiszeroed(sp->free_list));
+    q = m_calloc(size, 1);
+    for (usz i = 0; i < size; i++)
+        assert(q[i] == 0);
+    m_free(q);
+    m_free(p);
+    spfree(sp);
+
+    /* The page heap hands dirty runs to malloc() and clean runs to calloc(). */
+    config.backend = BACKEND_PAGES;
+    usz len = config.ph_minsz;
+    p = m_malloc(len);
+    q = m_malloc(len);
+    memset(p, 0xff, len);
+    m_free(p);
+    char *r = m_calloc(1, len);
+    assert(r != p && r[0] == 0 && r[len - 1] == 0);
+    assert(m_malloc(len) == p);
+    m_free(p);
+    m_free(q);
+    m_free(r);
+    segfree(heap->segbase);
+    config.backend = BACKEND_BLOCKS;
+}
+
+void test_large_cache(void) {
+    printf("==== test_large_cache ====\n");
+    usz size = 8 * 1024 * 1024;
+    usz maxsz = config.lc_maxsz;
+    usz ticks = config.lc_ticks;
+
+    /* Keep a small span around so that emptied large spans are let go. */
+    char *keep = m_malloc(64);
+
+    /* A freed large span goes to the cache and serves the next request. */
+    char *p = m_malloc(size);
+    struct span *sp = plblk(p)->owner;
+    m_free(p);
+    assert(heap->lc_count == 1 && heap->lc_bytes == sp->size && heap->span_count == 1);
+    char *q = m_malloc(size - 4096);
+    assert(plblk(q)->owner == sp && heap->lc_count == 0 && heap->span_count == 2);
+
+    /* Past the byte budget, the oldest span is evicted. */
+    config.lc_maxsz = size + size / 2;
+    p = m_malloc(size);
+    m_free(q);
+    m_free(p);
+    assert(heap->lc_count == 1 && heap->lc_bytes <= config.lc_maxsz);
+    assert(m_malloc(size) == p);
+    m_free(p);
+
+    /* A span that is not reused within lc_ticks decays, even if no large
+     * span is asked for or cached meanwhile.
+     */
+    config.lc_ticks = 10;
+    heap->lcscan_next = 0;
+    for (int i = 0; i < 20; i++)
+        m_free(m_malloc(64));
+    assert(heap->lc_count == 0);
+
+    lcflush();
+    assert(heap->lc_count == 0 && heap->lc_bytes == 0);
+    config.lc_maxsz = maxsz;
+    config.lc_ticks = ticks;
+    m_free(keep);
+    spfree(heap->base);
+}
+
+/* Run a fixed sequence of calls in deterministic mode in a child process and
+ * return a digest of the addresses it got.
+ */
+static u64 detrun(uptr hint) {
+    int fd[2];
+    assert(pipe(fd) == 0);
+
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        assert(osdetinit(hint, 256 * 1024 * 1024));
+        u64 h = 0;
+        char *ps[64];
+        for (usz backend = BACKEND_BLOCKS; backend <= BACKEND_BUDDY; backend++) {
+            config.backend = backend;
+            for (int i = 0; i < 64; i++) {
+                ps[i] = m_malloc(((usz)i * 7919) % (3 * 1024 * 1024));
+                h = h * 31 + (uptr)ps[i];
+                if (i % 3 == 0) {
+                    m_free(ps[i / 2]);
+                    ps[i / 2] = 0;
+                }
+            }
+            for (int i = 0; i < 64; i++)
+                m_free(ps[i]);
+        }
+        char *p = m_malloc(4 * 1024 * 1024);
+        assert((uptr)p >= hint && (uptr)p < hint + 256 * 1024 * 1024);
+        assert(write(fd[1], &h, sizeof(h)) == sizeof(h));
+        _exit(0);
+    }
+
+    u64 h;
+    int status;
+    assert(read(fd[0], &h, sizeof(h)) == sizeof(h));
+    assert(waitpid(pid, &status, 0) == pid && status == 0);
+    close(fd[0]);
+    close(fd[1]);
+    return h;
+}
+
+void test_deterministic(void) {
+    printf("==== test_deterministic ====\n");
+    uptr hint = (uptr)0x100000000000;
+
+    assert(configparse("det_base=0x100000000000,det_size=256m"));
+    assert(config.det_base == hint && config.det_size == 256 * 1024 * 1024);
+    config.det_base = 0;
+
+    /* Two runs of the same calls get the same addresses. */
+    assert(detrun(hint) == detrun(hint));
+}
+
+void test_telemetry(void) {
+    printf("==== test_telemetry ====\n");
+    struct stats before = stats;
+
+    /* The counters follow the calls made through the API. */
+    char *p = m_malloc(100);
+    char *q = m_calloc(2, 100);
+    assert(stats.nalloc == before.nalloc + 2);
+    assert(stats.live == before.live + plusable(p) + plusable(q));
+    p = m_realloc(p, 1000);
+    m_free(q);
+    assert(stats.nrealloc == before.nrealloc + 1 && stats.nfree == before.nfree + 1);
+    assert(stats.live == before.live + plusable(p));
+    m_free(p);
+    assert(stats.live == before.live && stats.mapped > 0);
+
+    /* With one in two events sampled, four calls publish two events. */
+    config.tm_ring = 4096;
+    config.tm_sample = 2;
+    assert(tminit());
+    assert(tmring->magic == TM_MAGIC && tmring->nslots >= 2);
+    p = m_malloc(64);
+    q = m_malloc(64);
+    m_free(p);
+    m_free(q);
+    assert(tmring->head == 2);
+    assert(tmring->ring[0].seq == 1 && tmring->ring[0].kind == TM_ALLOC);
+    assert(tmring->ring[0].p == (uptr)q && tmring->ring[0].size == 64);
+    assert(tmring->ring[1].seq == 2 && tmring->ring[1].kind == TM_FREE);
+    assert(tmring->statseq % 2 == 0 && tmring->stats.nfree == stats.nfree);
+
+    tmfini();
+    config.tm_ring = 0;
+    config.tm_sample = 16;
+    while (heap->base)
+        spfree(heap->base);
+}
+
+void test_snapshot(void) {
+    printf("==== test_snapshot ====\n");
+
+    /* sp -> [free] -> p2 (in use) -> p1 (free) */
+    char *p1 = m_malloc(100);
+    char *p2 = m_malloc(200);
+    struct span *sp = plblk(p1)->owner;
+    m_free(p1);
+    snapshot();
+    snapfini();
+
+    char path[sizeof(SNAP_PATH) + 20];
+    ospidpath(path, SNAP_PATH);
+    FILE *f = fopen(path, "rb");
+    assert(f);
+    u64 w[16];
+    usz n = fread(w, sizeof(u64), 16, f);
+    fclose(f);
+    remove(path);
+
+    assert(n == 10);
+    assert(w[0] == SNAP_MAGIC && w[2] == 1);
+    assert(w[3] == (uptr)sp && w[4] == sp->size && w[5] == SNAP_SPAN);
+    assert(w[6] == 3);
+    assert(w[7] == (sp->size - SPAN_HDR_PADSZ - blksize(plblk(p2)) - gross_size(100)));
+    assert(w[8] == (blksize(plblk(p2)) | SNAP_INUSE));
+    assert(w[9] == gross_size(100));
+
+    m_free(p2);
+    spfree(sp);
+}
+
+void test_config_file(void) {
+    printf("==== test_config_file ====\n");
+    struct config saved = config;
+    const char *path = "baby-malloc.test.conf";
+
+    /* A file in the form tune writes, which the environment overrides. */
+    FILE *f = fopen(path, "w");
+    assert(f);
+    fputs("backend=buddy\nspan_minsz=256k\nlc_maxsz=0\n", f);
+    fclose(f);
+    setenv("BABY_MALLOC_CONF_FILE", path, 1);
+    setenv("BABY_MALLOC_CONF", "lc_maxsz=1m", 1);
+    configinit();
+    unsetenv("BABY_MALLOC_CONF_FILE");
+    unsetenv("BABY_MALLOC_CONF");
+    remove(path);
+
+    assert(config.backend == BACKEND_BUDDY);
+    assert(config.span_minsz == 256 * 1024);
+    assert(config.lc_maxsz == 1024 * 1024);
+
+    /* Spans are at least span_minsz. */
+    config.backend = BACKEND_BLOCKS;
+    char *p = m_malloc(64);
+    assert(plblk(p)->owner->size == 256 * 1024);
+    m_free(p);
+    spfree(heap->base);
+    config = saved;
+}
+
+void test_utilization(void) {
+    printf("==== test_utilization ====\n");
+    struct m_utilization u;
+
+    /* A span with two blocks in use, then one. */
+    char *p1 = m_malloc(1000);
+    char *p2 = m_malloc(3000);
+    struct span *sp = plblk(p1)->owner;
+    usz size = sp->size - SPAN_HDR_PADSZ;
+    m_utilization(p1, &u);
+    assert(u.size == size);
+    assert(u.used == blksize(plblk(p1)) + blksize(plblk(p2)));
+    assert(u.heap_used == stats.live && u.heap_size == stats.mapped);
+    m_free(p2);
+    m_utilization(p1, &u);
+    assert(u.used == blksize(plblk(p1)));
+
+    /* A page heap segment counts pages. */
+    config.backend = BACKEND_PAGES;
+    char *q = m_malloc(config.ph_minsz);
+    m_utilization(q, &u);
+    assert(u.used == config.ph_minsz);
+    assert(u.size == (usz)(heap->segbase->npages - heap->segbase->hdrpages) * pagesize);
+    m_free(q);
+    segfree(heap->segbase);
+    config.backend = BACKEND_BLOCKS;
+
+    m_free(p1);
+    spfree(sp);
+}
+
+/* After a fork in cow mode, the child leaves the spans of the parent as they
+ * are: frees of inherited blocks do nothing and new blocks come from spans of
+ * its own. Inherited blocks stay live, and can shrink but not grow in place.
+ */
+void test_fork_cow(void) {
+    printf("==== test_fork_cow ====\n");
+    char *p = m_malloc(1000);
+    char *q = m_malloc(1000);
+    struct span *sp = plblk(p)->owner;
+    assert(!spinherited(sp) && plblk(q)->owner == sp);
+
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        spfork();
+        if (!spinherited(sp) || heap->base != 0 || plforeign(p))
+            _exit(1);
+        usz live = stats.live, size = blksize(plblk(p));
+        m_free(p);
+        if (blkisfree(plblk(p)) || sp->blkcount != 2 || stats.live != live)
+            _exit(2);
+        if (!plresize(q, 10) || blksize(plblk(q)) != size
+            || plresize(q, 2000))
+            _exit(5);
+        char *r = m_realloc(q, 2000);
+        if (!r || plblk(r)->owner == sp || blkisfree(plblk(q)))
+            _exit(3);
+        if (spinherited(plblk(r)->owner) || heap->base != plblk(r)->owner)
+            _exit(4);
+        if (stats.live != live + plusable(r))
+            _exit(6);
+        _exit(0);
+    }
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(!spinherited(sp));
+
+    m_free(p);
+    m_free(q);
+}
+
+/* A call site whose blocks outlive site_ticks gets spans of its own; one whose
+ * blocks are freed right away stays in the shared ones.
+ */
+void test_call_sites(void) {
+    printf("==== test_call_sites ====\n");
+    void *keep = (void *)0x1000, *temp = (void *)0x2000;
+    config.site_ticks = 100;
+    config.site_sample = 1;
+
+    char *ps[16];
+    for (int i = 0; i < 16; i++)
+        ps[i] = mallocfrom(64, keep);
+    for (int i = 0; i < 200; i++)
+        m_free(mallocfrom(64, temp));
+    for (int i = 0; i < 16; i++)
+        m_free(ps[i]);
+    assert(sitelong(siteof(keep)));
+    assert(!sitelong(siteof(temp)));
+
+    char *p = mallocfrom(64, keep);
+    char *q = mallocfrom(64, temp);
+    assert(plblk(p)->owner->flags & SPAN_LONG);
+    assert(!(plblk(q)->owner->flags & SPAN_LONG));
+    assert(plblk(p)->owner != plblk(q)->owner);
+
+    m_free(p);
+    m_free(q);
+    config.site_ticks = 0;
+    config.site_sample = 16;
+    while (heap->base)
+        spfree(heap->base);
+}
+
+/* The current tag is per thread; a new thread starts with none. */
+static void *tagworker(void *arg) {
+    *(unsigned *)arg = m_set_tag(0);
+    return 0;
+}
+
+void test_tags(void) {
+    printf("==== test_tags ====\n");
+    struct m_tag_stats ts;
+
+    /* Tagged explicitly and through the current tag, on every backend. */
+    char *p = m_malloc_tagged(100, 7);
+    assert(m_set_tag(7) == 0);
+    char *q = m_malloc(3000);
+    config.backend = BACKEND_PAGES;
+    char *r = m_calloc(1, 64 * 1024);
+    config.backend = BACKEND_BLOCKS;
+    unsigned other = 1;
+    pthread_t t;
+    assert(pthread_create(&t, 0, tagworker, &other) == 0);
+    assert(pthread_join(t, 0) == 0);
+    assert(other == 0);
+    assert(m_set_tag(0) == 7);
+    char *u = m_malloc(100);
+    m_tag_stats(7, &ts);
+    assert(ts.count == 3);
+    assert(ts.bytes == plusable(p) + plusable(q) + plusable(r));
+
+    /* A realloc that moves keeps the tag; frees uncount. */
+    usz old = plusable(q);
+    char *q2 = m_realloc(q, 100000);
+    assert(q2 != q);
+    m_tag_stats(7, &ts);
+    assert(ts.count == 3);
+    assert(ts.bytes == plusable(p) + plusable(q2) + plusable(r));
+    assert(ts.bytes != plusable(p) + old + plusable(r));
+
+    m_free(p);
+    m_free(r);
+    m_tag_stats(7, &ts);
+    assert(ts.count == 1 && ts.bytes == plusable(q2));
+    m_free(q2);
+    m_free(u);
+    m_tag_stats(7, &ts);
+    assert(ts.count == 0 && ts.bytes == 0);
+    assert(tgtab.count == 0);
+
+    /* Many tagged allocations, to grow the table, then free them all. */
+    char *ps[5000];
+    for (int i = 0; i < 5000; i++)
+        ps[i] = m_malloc_tagged(16, 1 + i % 3);
+    for (int i = 0; i < 5000; i += 2)
+        m_free(ps[i]);
+    usz n = 0, bytes = 0;
+    for (int i = 1; i < 5000; i += 2) {
+        if (i % 3 == 1) {
+            n++;
+            bytes += plusable(ps[i]);
+        }
+    }
+    m_tag_stats(2, &ts);
+    assert(ts.count == n && ts.bytes == bytes);
+    for (int i = 1; i < 5000; i += 2)
+        m_free(ps[i]);
+    for (u32 t = 1; t < 4; t++) {
+        m_tag_stats(t, &ts);
+        assert(ts.count == 0 && ts.bytes == 0);
+    }
+    assert(tgtab.count == 0);
+
+    while (heap->base)
+        spfree(heap->base);
+    while (heap->segbase)
+        segfree(heap->segbase);
+}
+
+void test_malloc_near(void) {
+    printf("==== test_malloc_near ====\n");
+
+    /* Fill a span, then free every other block. First fit takes the hole
+     * closest to the start of the span; near takes the one next to the hint.
+     */
+    char *ps[64];
+    for (int i = 0; i < 64; i++)
+        ps[i] = m_malloc(200);
+    struct span *sp = plblk(ps[0])->owner;
+    assert(plblk(ps[63])->owner == sp);
+    for (int i = 0; i < 64; i += 2) {
+        m_free(ps[i]);
+        ps[i] = 0;
+    }
+
+    char *hint = ps[41];
+    char *p = m_malloc_near(hint, 200);
+    assert(plblk(p)->owner == sp);
+    assert(p == ps[41] - blksize(plblk(hint)) || p == ps[41] + blksize(plblk(hint)));
+    char *q = m_malloc(200);
+    assert(q != p);
+
+    /* No room near the hint: served as usual. */
+    char *r = m_malloc_near(hint, 100000);
+    assert(r && plblk(r)->owner != sp);
+
+    /* Blocks near the hint are sampled for their call site like any other,
+     * and a site not known to be long-lived stays out of long-lived spans.
+     */
+    config.site_ticks = 100;
+    config.site_sample = 1;
+    char *u = m_malloc_near(hint, 200);
+    assert(plblk(u)->owner == sp && plblk(u)->next);
+    m_free(u);
+    sp->flags |= SPAN_LONG;
+    u = m_malloc_near(hint, 200);
+    assert(plblk(u)->owner != sp && !(plblk(u)->owner->flags & SPAN_LONG));
+    sp->flags &= ~SPAN_LONG;
+    config.site_ticks = 0;
+    config.site_sample = 16;
+
+    m_free(p);
+    m_free(q);
+    m_free(r);
+    m_free(u);
+    for (int i = 1; i < 64; i += 2)
+        m_free(ps[i]);
+    while (heap->base)
+        spfree(heap->base);
+}
+
+void test_heaps(void) {
+    printf("==== test_heaps ====\n");
+    assert(!m_heap_create("span_minsz=lots"));
+
+    /* Each heap serves from spans of its own, sized by its own knobs. */
+    struct m_heap *h = m_heap_create("span_minsz=256k");
+    assert(h);
+    char *p = m_heap_malloc(h, 100);
+    char *q = m_malloc(100);
+    struct span *sp = plblk(p)->owner;
+    assert(sp->heap == (struct heap *)h && sp->size == 256 * 1024);
+    assert(plblk(q)->owner->heap == &defheap);
+    assert(plblk(q)->owner->size == MIN_MMAPSZ);
+    assert(heap == &defheap && !plforeign(p));
+
+    /* Reallocs stay in the heap of the pointer, and frees go back to it. */
+    char *r = m_realloc(p, 10000);
+    assert(plblk(r)->owner->heap == (struct heap *)h);
+    assert(heap == &defheap);
+    m_free(r);
+    assert(sp->blkcount == 0 && heap == &defheap);
+
+    /* A page heap of its own; destroying it drops what is live in it. */
+    usz live = stats.live;
+    struct m_heap *g = m_heap_create("backend=pages,ph_minsz=4k");
+    char *x = m_heap_calloc(g, 1, 8192);
+    assert(pmget(x)->heap == (struct heap *)g && x[8191] == 0);
+    assert(stats.live == live + 8192);
+    m_heap_destroy(g);
+    assert(stats.live == live && defheap.next == (struct heap *)h);
+
+    /* Destroying a heap uncounts the tags of what was live in it, and leaves
+     * nothing behind for whatever takes its place.
+     */
+    struct m_tag_stats ts;
+    struct m_heap *t = m_heap_create("span_minsz=256k");
+    char *y = m_heap_malloc(t, 100);
+    assert(m_set_tag(5) == 0);
+    char *z = m_heap_malloc(t, 200);
+    m_set_tag(0);
+    m_tag_stats(5, &ts);
+    assert(ts.count == 1 && ts.bytes == plusable(z));
+    m_heap_destroy(t);
+    m_tag_stats(5, &ts);
+    assert(ts.count == 0 && ts.bytes == 0 && !ptget(&tgtab, z));
+    t = m_heap_create("span_minsz=256k");
+    assert(m_heap_malloc(t, 100) == y && m_heap_malloc(t, 200) == z);
+    m_free(z);
+    m_tag_stats(5, &ts);
+    assert(ts.count == 0 && ts.bytes == 0);
+    m_heap_destroy(t);
+
+    m_heap_destroy(h);
+    assert(defheap.next == 0);
+    m_free(q);
+    while (heap->base)
+        spfree(heap->base);
+}
+
+enum {
+    POOLTEST_THREADS = 4,
+    POOLTEST_HELD = 500,
+    POOLTEST_ROUNDS = 200,
+};
+
+/* Hold POOLTEST_HELD objects at a time, marked with the thread's id, and
+ * check that no other thread was handed one of them meanwhile.
+ */
+static void *poolworker(void *arg) {
+    struct m_pool *pl = ((void **)arg)[0];
+    uptr id = (uptr)((void **)arg)[1];
+    uptr *held[POOLTEST_HELD];
+    for (int r = 0; r < POOLTEST_ROUNDS; r++) {
+        int n = r % 2 ? POOLTEST_HELD : POOLTEST_HELD / 3;
+        for (int i = 0; i < n; i++) {
+            held[i] = m_pool_alloc(pl);
+            assert(held[i]);
+            held[i][0] = id;
+            held[i][3] = id;
+        }
+        for (int i = n - 1; i >= 0; i--) {
+            assert(held[i][0] == id && held[i][3] == id);
+            m_pool_free(pl, held[i]);
+        }
+    }
+    return 0;
+}
+
+/* Free the objects in arg, a pool and a null-terminated list, and nothing
+ * else.
+ */
+static void *poolfreer(void *arg) {
+    void **a = arg;
+    for (int i = 1; a[i]; i++)
+        m_pool_free(a[0], a[i]);
+    return 0;
+}
+
+static void *poolallocer(void *arg) {
+    return m_pool_alloc(arg);
+}
+
+/* Free an object from a thread exit handler that runs after the one that
+ * gives back the thread's shard.
+ */
+static pthread_key_t latekey;
+static struct m_pool *latepool;
+
+static void latefree(void *p) {
+    m_pool_free(latepool, p);
+}
+
+static void *latefreer(void *arg) {
+    pthread_setspecific(latekey, arg);
+    m_pool_free(latepool, m_pool_alloc(latepool));
+    return 0;
+}
+
+void test_pool(void) {
+    printf("==== test_pool ====\n");
+
+    /* Objects are aligned, at least 32 bytes apart, and come back LIFO. */
+    struct m_pool *pl = m_pool_create(20);
+    assert(pl);
+    byte *a = m_pool_alloc(pl);
+    byte *b = m_pool_alloc(pl);
+    assert((uptr)a % ALIGNMENT == 0 && (uptr)b % ALIGNMENT == 0);
+    assert(a + 32 == b);
+    m_pool_free(pl, b);
+    assert(m_pool_alloc(pl) == b);
+
+    /* Threads share the pool, freeing to magazines that others pop. */
+    struct m_stats s0, s1, s2;
+    m_stats(&s0);
+    struct m_pool *q = m_pool_create(32);
+    pthread_t t[POOLTEST_THREADS];
+    void *args[POOLTEST_THREADS][2];
+    for (uptr i = 0; i < POOLTEST_THREADS; i++) {
+        args[i][0] = q;
+        args[i][1] = (void *)(i + 1);
+        assert(pthread_create(&t[i], 0, poolworker, args[i]) == 0);
+    }
+    for (int i = 0; i < POOLTEST_THREADS; i++)
+        pthread_join(t[i], 0);
+
+    /* The counts of the threads' shards outlive them. */
+    usz nalloc = 0;
+    for (int r = 0; r < POOLTEST_ROUNDS; r++)
+        nalloc += r % 2 ? POOLTEST_HELD : POOLTEST_HELD / 3;
+    m_stats(&s1);
+    assert(s1.nalloc - s0.nalloc == POOLTEST_THREADS * nalloc);
+    assert(s1.nfree - s0.nfree == POOLTEST_THREADS * nalloc);
+    assert(s1.live == s0.live && s1.mapped > s0.mapped);
+
+    /* What exited threads held went back to the depot, and is enough for
+     * one of them to run again, in a shard one of them left.
+     */
+    assert(pthread_create(&t[0], 0, poolworker, args[0]) == 0);
+    pthread_join(t[0], 0);
+    m_stats(&s2);
+    assert(s2.mapped == s1.mapped && s2.nalloc - s1.nalloc == nalloc);
+
+    /* A thread that only frees hands its magazine back too. */
+    void *objs[12] = { q };
+    for (int i = 1; i < 11; i++)
+        objs[i] = m_pool_alloc(q);
+    assert(pthread_create(&t[0], 0, poolfreer, objs) == 0);
+    pthread_join(t[0], 0);
+    void *got;
+    assert(pthread_create(&t[0], 0, poolallocer, q) == 0);
+    pthread_join(t[0], &got);
+    assert(got == objs[10]);
+    m_pool_free(q, got);
+
+    /* Counts made after a thread gave its shard back still add up. */
+    latepool = q;
+    assert(pthread_key_create(&latekey, latefree) == 0);
+    void *late = m_pool_alloc(q);
+    m_stats(&s1);
+    assert(pthread_create(&t[0], 0, latefreer, late) == 0);
+    pthread_join(t[0], 0);
+    m_stats(&s2);
+    assert(s2.nfree - s1.nfree == 2 && s2.live == s1.live - 32);
+    pthread_key_delete(latekey);
+
+    m_pool_destroy(q);
+    m_pool_free(pl, a);
+    m_pool_free(pl, b);
+    m_pool_destroy(pl);
+    m_stats(&s2);
+    assert(s2.mapped < s1.mapped && s2.live == s0.live - 2 * 32);  /* a, b */
+}
+
+void test_leaks(void) {
+    printf("==== test_leaks ====\n");
+    config.leak_every = 3;
+    config.leak_sample = 1;
+    config.leak_runs = 3;
+
+    /* One site keeps what it allocates, the other frees it right away, and
+     * a profile is taken once per round.
+     */
+    char *kept[7];
+    for (int i = 0; i < 7; i++) {
+        kept[i] = m_malloc(100);
+        m_free(m_malloc(100));
+    }
+    assert(lktab.count == 7);
+    kept[0] = m_realloc(kept[0], 1000);
+    assert(lktab.count == 7);
+    m_leak_report();
+    leakfini();
+
+    char path[sizeof(LEAK_PATH) + 20];
+    ospidpath(path, LEAK_PATH);
+    FILE *f = fopen(path, "r");
+    assert(f);
+    char line[128];
+    unsigned long long pc, size, grown;
+    int profile, runs, nlines = 0;
+    while (fgets(line, sizeof(line), f)) {
+        assert(sscanf(line, "profile %d: site 0x%llx grew %d times to %llu "
+            "bytes (+%llu)", &profile, &pc, &runs, &size, &grown) == 5);
+        assert(runs == profile && size == grown);
+        nlines++;
+    }
+    fclose(f);
+    remove(path);
+
+    /* Reported after 3 and 6 profiles, and once more by hand after the 7th,
+     * with the realloc counted in.
+     */
+    assert(nlines == 3);
+    assert(runs == 7 && size == 6 * plusable(kept[1]) + plusable(kept[0]));
+
+    for (int i = 0; i < 7; i++)
+        m_free(kept[i]);
+    assert(lktab.count == 0);
+    config.leak_every = 0;
+    while (heap->base)
+        spfree(heap->base);
+}
+
+/* calloc() call sites are followed like those of malloc(). */
+void test_calloc_leaks(void) {
+    printf("==== test_calloc_leaks ====\n");
+    void *site = (void *)0x3000;
+    config.leak_every = 1;
+    config.leak_sample = 1;
+    config.leak_runs = 0;
+
+    usz sampled = lktab.count;
+    char *p = m_calloc(10, 10);
+    assert(lktab.count == sampled + 1 && ptget(&lktab, p));
+    m_free(p);
+
+    char *kept[4];
+    for (int i = 0; i < 4; i++)
+        kept[i] = callocfrom(10, 10, site);
+    m_leak_report();
+    leakfini();
+
+    char path[sizeof(LEAK_PATH) + 20];
+    ospidpath(path, LEAK_PATH);
+    FILE *f = fopen(path, "r");
+    assert(f);
+    char line[128];
+    unsigned long long pc, size, grown;
+    int profile, runs, found = 0;
+    while (fgets(line, sizeof(line), f)) {
+        assert(sscanf(line, "profile %d: site 0x%llx grew %d times to %llu "
+            "bytes (+%llu)", &profile, &pc, &runs, &size, &grown) == 5);
+        if (pc == (uptr)site)
+            found = runs == 3 && size == 4 * plusable(kept[0]);
+    }
+    fclose(f);
+    remove(path);
+    assert(found);
+
+    for (int i = 0; i < 4; i++)
+        m_free(kept[i]);
+    config.leak_every = 0;
+    while (heap->base)
+        spfree(heap->base);
+}
+
+void test_va_headroom(void) {
+    printf("==== test_va_headroom ====\n");
+    config.va_headroom = 64 * 1024 * 1024;
+
+    /* The first growth past the span moves p, to a span with twice its size
+     * reserved behind it.
+     */
+    char *p = m_malloc(100 * 1024);
+    memset(p, 'a', 100 * 1024);
+    char *q = m_realloc(p, 200 * 1024);
+    assert(q != p && q[100 * 1024 - 1] == 'a');
+    struct span *sp = plblk(q)->owner;
+    usz size = sp->size;
+    assert(sp->ngrow == 1 && (usz)sp->headroom * pagesize == 2 * size);
+
+    /* From then on it grows in place, into the headroom. */
+    usz mapped = stats.mapped;
+    for (usz n = 200 * 1024; n <= 3 * size - 4096; n += 8192) {
+        assert(m_realloc(q, n) == q);
+        q[n - 1] = 'b';
+    }
+    assert(sp->size == 3 * size && sp->headroom == 0);
+    assert(stats.mapped == mapped + 2 * size && q[0] == 'a');
+
+    /* Outgrowing it moves again, with four times the span reserved. */
+    char *r = m_realloc(q, 4 * size);
+    assert(r != q && r[0] == 'a' && plblk(r)->owner->ngrow == 2);
+    sp = plblk(r)->owner;
+    size = sp->size;
+    assert((usz)sp->headroom * pagesize == 4 * size);
+
+    /* A shrink gives the tail back to the headroom, and a growth takes it
+     * again without moving.
+     */
+    mapped = stats.mapped;
+    assert(m_realloc(r, 1000) == r);
+    assert(sp->size < size / 2 && stats.mapped == mapped - (size - sp->size));
+    assert((usz)sp->headroom * pagesize == 5 * size - sp->size);
+    assert(m_realloc(r, 2 * size) == r && r[0] == 'a');
+    m_free(r);
+
+    config.va_headroom = 0;
+    while (heap->base)
+        spfree(heap->base);
+
+    /* The knob is per heap. */
+    struct m_heap *h = m_heap_create("va_headroom=64m");
+    char *x = m_realloc(m_heap_malloc(h, 100 * 1024), 200 * 1024);
+    sp = plblk(x)->owner;
+    assert(sp->heap == (struct heap *)h && sp->headroom && sp->ngrow == 1);
+    char *y = m_realloc(m_malloc(100 * 1024), 200 * 1024);
+    assert(!plblk(y)->owner->headroom);
+    m_free(y);
+    m_heap_destroy(h);
+
+    while (heap->base)
+        spfree(heap->base);
+}
+
+/* The hooks live in the exported API, so test_hooks() drives a copy of the
+ * allocator loaded from malloc.so, with a state of its own.
+ */
+static struct {
+    void *(*malloc)(size_t);
+    void (*free)(void *);
+    void *(*calloc)(size_t, size_t);
+    void *(*realloc)(void *, size_t);
+    size_t (*usable)(void *);   /* plusable() */
+} so;
+
+static struct {
+    int nalloc, nfree;
+    void *p;                    /* last pointer seen */
+    size_t size, usable;        /* last sizes seen */
+} seen;
+
+static void countalloc(void *p, size_t size, size_t usable) {
+    seen.nalloc++;
+    seen.p = p;
+    seen.size = size;
+    seen.usable = usable;
+    /* Not reported: the hook is running. */
+    so.free(so.malloc(10));
+}
+
+static void countfree(void *p, size_t usable) {
+    seen.nfree++;
+    seen.p = p;
+    seen.usable = usable;
+}
+
+void test_hooks(void) {
+    printf("==== test_hooks ====\n");
+    void *h = dlopen("./malloc.so", RTLD_NOW | RTLD_LOCAL);
+    assert(h);
+    *(void **)&so.malloc = dlsym(h, "malloc");
+    *(void **)&so.free = dlsym(h, "free");
+    *(void **)&so.calloc = dlsym(h, "calloc");
+    *(void **)&so.realloc = dlsym(h, "realloc");
+    *(void **)&so.usable = dlsym(h, "plusable");
+    void (*sethooks)(void (*)(void *, size_t, size_t), void (*)(void *, size_t));
+    *(void **)&sethooks = dlsym(h, "malloc_set_hooks");
+    assert(so.malloc && so.free && so.calloc && so.realloc && so.usable);
+    assert(sethooks);
+    sethooks(countalloc, countfree);
+
+    char *p = so.malloc(100);
+    assert(seen.nalloc == 1 && seen.nfree == 0 && seen.p == p);
+    assert(seen.size == 100 && seen.usable == so.usable(p));
+
+    char *q = so.calloc(10, 30);
+    assert(seen.nalloc == 2 && seen.p == q && seen.size == 300);
+
+    /* A realloc is a free and an allocation, whether it moves or not. */
+    char *r = so.realloc(p, 50);
+    assert(r == p && seen.nfree == 1 && seen.nalloc == 3);
+    assert(seen.p == r && seen.size == 50 && seen.usable == so.usable(r));
+    r = so.realloc(r, 100000);
+    assert(r != p && seen.nfree == 2 && seen.nalloc == 4 && seen.p == r);
+    assert(seen.size == 100000);
+
+    size_t old = so.usable(r);
+    so.free(r);
+    assert(seen.nfree == 3 && seen.p == r && seen.usable == old);
+    so.free(0);
+    assert(seen.nfree == 3);
+
+    /* Removing the hooks stops the calls. */
+    sethooks(0, 0);
+    so.free(q);
+    assert(seen.nfree == 3 && seen.nalloc == 4);
+    dlclose(h);
 }
@@ -0,0 +1,111 @@
+#define _GNU_SOURCE /* nanosleep, kill */
+
+#include <errno.h>
+#include <fcntl.h> /* open */
+#include <signal.h> /* kill */
+#include <stdio.h>
+#include <stdlib.h> /* strtol */
+#include <string.h> /* memcpy */
+#include <sys/mman.h> /* mmap */
+#include <sys/stat.h> /* fstat */
+#include <time.h> /* nanosleep */
+#include <unistd.h> /* close, unlink */
+
+#include "internal.h"
+
+/* Attach to the telemetry ring of a running process and stream its events
+ * and stats to stdout, until the process exits.
+ *
+ *    $ BABY_MALLOC_CONF=tm_ring=1m LD_PRELOAD=./malloc.so ./server &
+ *    $ ./tmread $!
+ *
+ * The ring is only read; the process never waits for the reader. Events the
+ * reader was too slow for are counted as lost.
+ */
+
+static const char *const kinds[] = { "?", "alloc", "free", "realloc" };
+
+/* Copy the event with number seq out of the ring. Return false if it has
+ * been overwritten in the meantime.
+ */
+static int readevent(struct tmring *r, u64 seq, struct tmevent *out) {
+    struct tmevent *e = &r->ring[seq & (r->nslots - 1)];
+    u64 s = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+    memcpy(out, e, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return s == seq + 1 && __atomic_load_n(&e->seq, __ATOMIC_RELAXED) == s;
+}
+
+/* Copy a consistent stats snapshot out of the ring.
+ */
+static void readstats(struct tmring *r, struct stats *out) {
+    for (;;) {
+        u64 s = __atomic_load_n(&r->statseq, __ATOMIC_ACQUIRE);
+        if (s & 1)
+            continue;
+        memcpy(out, &r->stats, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&r->statseq, __ATOMIC_RELAXED) == s)
+            return;
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s pid [interval_ms]\n", argv[0]);
+        return 2;
+    }
+    long pid = strtol(argv[1], 0, 10);
+    long ms = argc > 2 ? strtol(argv[2], 0, 10) : 1000;
+
+    char path[sizeof(TM_PATH) + 20];
+    snprintf(path, sizeof(path), "%s%ld", TM_PATH, pid);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        perror(path);
+        return 1;
+    }
+    struct tmring *r = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r == MAP_FAILED || r->magic != TM_MAGIC) {
+        fprintf(stderr, "%s: not a telemetry ring\n", path);
+        return 1;
+    }
+
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    u64 next = 0, lost = 0;
+    for (;;) {
+        int alive = kill(pid, 0) == 0 || errno != ESRCH;
+        u64 head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (head - next > r->nslots) {
+            lost += head - r->nslots - next;
+            next = head - r->nslots;
+        }
+        for (; next < head; next++) {
+            struct tmevent e;
+            if (!readevent(r, next, &e)) {
+                lost++;
+                continue;
+            }
+            printf("%" PRIu64 " %s %#" PRIx64 " %" PRIu64,
+                e.tick, kinds[e.kind < 4 ? e.kind : 0], e.p, e.size);
+            if (e.kind == TM_REALLOC)
+                printf(" from %#" PRIx64, e.q);
+            printf("\n");
+        }
+
+        struct stats s;
+        readstats(r, &s);
+        printf("stats alloc=%" PRIu64 " free=%" PRIu64 " realloc=%" PRIu64
+            " live=%" PRIu64 " mapped=%" PRIu64 " lost=%" PRIu64 "\n",
+            s.nalloc, s.nfree, s.nrealloc, s.live, s.mapped, lost);
+        fflush(stdout);
+
+        if (!alive) {
+            unlink(path);
+            return 0;
+        }
+        nanosleep(&ts, 0);
+    }
+}
@@ -0,0 +1,308 @@
+#define _GNU_SOURCE /* fork, pipe */
+
+#include <stdio.h>
+#include <stdlib.h> /* malloc, realloc, strtoull */
+#include <string.h> /* strcmp */
+#include <sys/wait.h> /* waitpid */
+#include <unistd.h> /* fork, pipe, read, write */
+
+#include "internal.h"
+
+/* Find the knobs that suit a workload best by replaying a trace of it against
+ * the allocator with different settings:
+ *
+ *    $ BABY_MALLOC_CONF=tm_ring=64m,tm_sample=1 LD_PRELOAD=./malloc.so ./server &
+ *    $ ./tmread $! > trace
+ *    $ ./tune trace > server.conf
+ *    $ BABY_MALLOC_CONF_FILE=server.conf LD_PRELOAD=./malloc.so ./server
+ *
+ * The trace is the output of tmread; pointers that were allocated before it
+ * started, or whose allocation was not sampled, are skipped. The allocator
+ * itself is linked in, so the simulation is exact. Each setting is replayed
+ * in a child process, which starts from a clean heap and reports the peak of
+ * the bytes mapped and the number of system calls made. The cost of a
+ * setting is its peak mapped bytes plus -w bytes (64k by default) for each
+ * system call.
+ *
+ * The knobs are tuned one at a time, keeping the best value of each, and the
+ * whole round is repeated until nothing improves.
+ */
+
+struct op {
+    u32 kind;                   /* TM_ALLOC, TM_FREE or TM_REALLOC */
+    u32 id;                     /* object the op is about */
+    u64 size;
+};
+
+struct result {
+    u64 peak_mapped;
+    u64 peak_live;
+    u64 nsys;
+};
+
+static struct op *ops;
+static usz nops;
+static u32 nobjs;
+
+/* Trace pointers to object ids, open addressing. A key of 0 is empty. */
+static u64 *keys;
+static u32 *vals;
+static usz mapcap;
+static usz mapused;             /* keys, live or deleted */
+
+static const char *const backends[] = { "blocks", "pages", "buddy" };
+
+#define K 1024
+#define M (1024 * 1024)
+
+static const struct knob {
+    const char *name;
+    usz *val;
+    usz cand[8];                /* candidate values, ending in ~0 */
+} knobs[] = {
+    { "backend", &config.backend, { 0, 1, 2, ~(usz)0 } },
+    { "span_minsz", &config.span_minsz,
+        { 16 * K, 32 * K, 64 * K, 128 * K, 256 * K, 1 * M, ~(usz)0 } },
+    { "ph_minsz", &config.ph_minsz,
+        { 4 * K, 8 * K, 16 * K, 32 * K, 64 * K, ~(usz)0 } },
+    { "ph_maxsz", &config.ph_maxsz,
+        { 256 * K, 512 * K, 1 * M, 2 * M, ~(usz)0 } },
+    { "bd_minsz", &config.bd_minsz, { 4 * K, 16 * K, 64 * K, ~(usz)0 } },
+    { "bd_maxsz", &config.bd_maxsz, { 1 * M, 4 * M, 32 * M, ~(usz)0 } },
+    { "lc_minsz", &config.lc_minsz, { 256 * K, 1 * M, 4 * M, ~(usz)0 } },
+    { "lc_maxsz", &config.lc_maxsz,
+        { 0, 16 * M, 64 * M, 256 * M, ~(usz)0 } },
+};
+
+enum {
+    NKNOBS = sizeof(knobs) / sizeof(knobs[0]),
+};
+
+static void *xrealloc(void *p, usz size) {
+    p = realloc(p, size);
+    if (!p) {
+        perror("tune");
+        exit(1);
+    }
+    return p;
+}
+
+static usz slot(u64 key) {
+    usz i = (key >> 4) * 0x9e3779b97f4a7c15ull & (mapcap - 1);
+    while (keys[i] && keys[i] != key)
+        i = (i + 1) & (mapcap - 1);
+    return i;
+}
+
+static void mapgrow(void) {
+    u64 *ok = keys;
+    u32 *ov = vals;
+    usz ocap = mapcap;
+    mapcap = mapcap ? 2 * mapcap : 1024;
+    keys = calloc(mapcap, sizeof(u64));
+    vals = calloc(mapcap, sizeof(u32));
+    if (!keys || !vals) {
+        perror("tune");
+        exit(1);
+    }
+    mapused = 0;
+    for (usz i = 0; i < ocap; i++) {
+        if (ok[i] && ok[i] != ~(u64)0) {
+            mapused++;
+            usz j = slot(ok[i]);
+            keys[j] = ok[i];
+            vals[j] = ov[i];
+        }
+    }
+    free(ok);
+    free(ov);
+}
+
+/* Deleted keys are marked with ~0 so probing carries on past them. */
+static void mapput(u64 key, u32 id) {
+    if (2 * (mapused + 1) > mapcap)
+        mapgrow();
+    usz i = slot(key);
+    if (!keys[i])
+        mapused++;
+    keys[i] = key;
+    vals[i] = id;
+}
+
+static int maptake(u64 key, u32 *id) {
+    if (!mapcap)
+        return 0;
+    usz i = slot(key);
+    if (!keys[i])
+        return 0;
+    *id = vals[i];
+    keys[i] = ~(u64)0;
+    return 1;
+}
+
+static void addop(u32 kind, u32 id, u64 size) {
+    static usz cap;
+    if (nops == cap) {
+        cap = cap ? 2 * cap : 4096;
+        ops = xrealloc(ops, cap * sizeof(struct op));
+    }
+    ops[nops].kind = kind;
+    ops[nops].id = id;
+    ops[nops].size = size;
+    nops++;
+}
+
+static void readtrace(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+
+    char line[256], kind[16];
+    u64 tick, p, size, q;
+    u32 id;
+    while (fgets(line, sizeof(line), f)) {
+        int n = sscanf(line, "%" SCNu64 " %15s %" SCNx64 " %" SCNu64
+            " from %" SCNx64, &tick, kind, &p, &size, &q);
+        if (n < 4 || !p)
+            continue;
+        if (!strcmp(kind, "alloc")) {
+            mapput(p, nobjs);
+            addop(TM_ALLOC, nobjs++, size);
+        } else if (!strcmp(kind, "free")) {
+            if (maptake(p, &id))
+                addop(TM_FREE, id, 0);
+        } else if (!strcmp(kind, "realloc") && n == 5) {
+            if (maptake(q, &id)) {
+                mapput(p, id);
+                addop(TM_REALLOC, id, size);
+            }
+        }
+    }
+    fclose(f);
+}
+
+/* Replay the trace with the current config. Runs in the child. */
+static struct result replay(void) {
+    struct result r = { 0, 0, 0 };
+    void **live = calloc(nobjs ? nobjs : 1, sizeof(void *));
+    if (!live)
+        exit(1);
+
+    u64 nsys = stats.nsys;
+    for (usz i = 0; i < nops; i++) {
+        struct op *o = &ops[i];
+        switch (o->kind) {
+        case TM_ALLOC:
+            live[o->id] = m_malloc(o->size);
+            break;
+        case TM_FREE:
+            m_free(live[o->id]);
+            live[o->id] = 0;
+            break;
+        case TM_REALLOC:
+            live[o->id] = m_realloc(live[o->id], o->size);
+            break;
+        }
+        if (stats.mapped > r.peak_mapped)
+            r.peak_mapped = stats.mapped;
+        if (stats.live > r.peak_live)
+            r.peak_live = stats.live;
+    }
+    r.nsys = stats.nsys - nsys;
+    return r;
+}
+
+/* Replay in a child, so that every setting starts from a clean heap. */
+static struct result evaluate(void) {
+    struct result r;
+    int fd[2];
+    if (pipe(fd)) {
+        perror("tune");
+        exit(1);
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        r = replay();
+        _exit(write(fd[1], &r, sizeof(r)) != sizeof(r));
+    }
+    close(fd[1]);
+    int status;
+    if (pid < 0 || read(fd[0], &r, sizeof(r)) != sizeof(r)) {
+        fprintf(stderr, "tune: replay failed\n");
+        exit(1);
+    }
+    close(fd[0]);
+    waitpid(pid, &status, 0);
+    return r;
+}
+
+static u64 cost(struct result r, u64 w) {
+    return r.peak_mapped + r.nsys * w;
+}
+
+static void printval(FILE *f, const struct knob *k, usz v) {
+    if (k->val == &config.backend)
+        fprintf(f, "%s", backends[v]);
+    else if (v && v % M == 0)
+        fprintf(f, "%zum", v / M);
+    else if (v && v % K == 0)
+        fprintf(f, "%zuk", v / K);
+    else
+        fprintf(f, "%zu", v);
+}
+
+int main(int argc, char **argv) {
+    u64 w = 64 * K;
+    int i = 1;
+    if (argc > 2 && !strcmp(argv[1], "-w")) {
+        w = strtoull(argv[2], 0, 10);
+        i = 3;
+    }
+    if (i != argc - 1) {
+        fprintf(stderr, "usage: %s [-w bytes_per_syscall] trace > conf\n",
+            argv[0]);
+        return 2;
+    }
+    readtrace(argv[i]);
+    fprintf(stderr, "%zu ops on %u objects\n", nops, nobjs);
+
+    /* Knobs from the environment are the starting point. */
+    minit();
+    struct result best = evaluate();
+    fprintf(stderr, "start: peak %" PRIu64 " mapped for %" PRIu64
+        " live, %" PRIu64 " syscalls\n",
+        best.peak_mapped, best.peak_live, best.nsys);
+
+    for (b32 better = 1; better; ) {
+        better = 0;
+        for (int j = 0; j < NKNOBS; j++) {
+            const struct knob *k = &knobs[j];
+            usz keep = *k->val;
+            for (int c = 0; k->cand[c] != ~(usz)0; c++) {
+                if (k->cand[c] == keep)
+                    continue;
+                *k->val = k->cand[c];
+                struct result r = evaluate();
+                if (cost(r, w) < cost(best, w)) {
+                    best = r;
+                    keep = k->cand[c];
+                    better = 1;
+                }
+            }
+            *k->val = keep;
+        }
+    }
+
+    fprintf(stderr, "tuned: peak %" PRIu64 " mapped for %" PRIu64
+        " live, %" PRIu64 " syscalls\n",
+        best.peak_mapped, best.peak_live, best.nsys);
+    for (int j = 0; j < NKNOBS; j++) {
+        printf("%s=", knobs[j].name);
+        printval(stdout, &knobs[j], *knobs[j].val);
+        printf("\n");
+    }
+    return 0;
+}